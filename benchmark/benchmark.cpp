@@ -7,8 +7,17 @@
 #include <fstream>
 #include <csignal>
 #include <algorithm>
+#include <map>
+#include <memory_resource>
+
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <unistd.h>
 
 #include "../bmslab.h"
+#include "../bmslab.hpp"
 
 enum class AllocMode {
 	BMSLAB,
@@ -17,19 +26,38 @@ enum class AllocMode {
 
 static int g_threadCount = 1;
 static int g_runSeconds = 10;
-static int g_benchMode = 1; // B=1,2,3
+static int g_benchMode = 1; // B=1,2,3,4,5,6,7,8,9,10,11,12
 static AllocMode g_allocMode = AllocMode::MALLOC;
 
 static int g_objSize = 128;
 static int g_maxPageCount = 256;
 static int g_chunkSize = 1000;
 static int g_phaseInterval = 5;
+static int g_magazineSize = 0; // allocMode option "+mag"
+static bool g_bulk = false; // allocMode option "+bulk" (B=2)
+static bool g_hugePage = false; // allocMode option "+huge"
+static bool g_backgroundReclaim = false; // allocMode option "+bg"
+static int g_decayMs = 0; // allocMode option "+decay" (10s)
+static int g_purgeMethod = BMSLAB_PURGE_FREE; // allocMode option "+dontneed"
+static bool g_homePlacement = false; // allocMode option "+home"
+static bool g_cachelineLayout = false; // allocMode option "+line"
+static int g_slotAlign = 0; // allocMode option "+align" (64)
+static bool g_colouring = false; // allocMode option "+colour"
+static bool g_freeAny = false; // allocMode option "+any" (B=1,2)
+static bool g_pmr = false; // allocMode option "+pmr" (B=12)
+// allocMode option "+scalar", "+sse2", "+avx2" or "+avx512"
+static int g_simdLevel = BMSLAB_SIMD_AUTO;
 
 static bmslab *g_slab = NULL;
+static bmslab_multi *g_multi = NULL; // B=4, B=12
+static std::unique_ptr<std::pmr::memory_resource> g_mapResource; // B=12 +pmr
+static std::vector<void *> g_prefillPtrs; // B=5
 static std::atomic<bool> g_stopFlag {false};
 
 static std::atomic<long long> g_allocCount{0};
 static std::atomic<long long> g_freeCount{0};
+static std::atomic<long long> g_touchCount{0}; // B=6, B=8 (writes), B=9, B=10
+static std::atomic<long long> g_touchCacheMisses{0}; // B=6,9,10, -1 if n/a
 
 // (B=3) alloc/free pattern
 struct LoadPhase {
@@ -48,6 +76,106 @@ static std::ofstream g_finalResult;
 
 static auto g_benchStartTime = std::chrono::steady_clock::now();
 
+// "bmslab+mag+bulk" => base "bmslab" with options "mag" and "bulk"
+static std::string parseAllocMode(const std::string &modeStr) {
+	std::string base;
+	size_t pos = 0;
+
+	while (pos <= modeStr.size()) {
+		size_t next = modeStr.find('+', pos);
+		if (next == std::string::npos) {
+			next = modeStr.size();
+		}
+
+		std::string token = modeStr.substr(pos, next - pos);
+		if (base.empty()) {
+			base = token;
+		} else if (token == "mag") {
+			g_magazineSize = 64;
+		} else if (token == "bulk") {
+			g_bulk = true;
+		} else if (token == "huge") {
+			g_hugePage = true;
+		} else if (token == "bg") {
+			g_backgroundReclaim = true;
+		} else if (token == "decay") {
+			g_decayMs = 10000;
+		} else if (token == "dontneed") {
+			g_purgeMethod = BMSLAB_PURGE_DONTNEED;
+		} else if (token == "home") {
+			g_homePlacement = true;
+		} else if (token == "line") {
+			g_cachelineLayout = true;
+		} else if (token == "align") {
+			g_slotAlign = 64;
+		} else if (token == "colour") {
+			g_colouring = true;
+		} else if (token == "any") {
+			g_freeAny = true;
+		} else if (token == "pmr") {
+			g_pmr = true;
+		} else if (token == "scalar") {
+			g_simdLevel = BMSLAB_SIMD_SCALAR;
+		} else if (token == "sse2") {
+			g_simdLevel = BMSLAB_SIMD_SSE2;
+		} else if (token == "avx2") {
+			g_simdLevel = BMSLAB_SIMD_AVX2;
+		} else if (token == "avx512") {
+			g_simdLevel = BMSLAB_SIMD_AVX512;
+		} else {
+			std::cerr << "Unknown allocMode option: " << token << "\n";
+		}
+		pos = next + 1;
+	}
+
+	return base;
+}
+
+// Hardware cache misses of the calling thread, -1 if perf events are n/a
+int openCacheMissCounter() {
+	struct perf_event_attr attr = {};
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	int perfFd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (perfFd >= 0) {
+		ioctl(perfFd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(perfFd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	return perfFd;
+}
+
+// Adds the misses counted by perfFd to g_touchCacheMisses
+void closeCacheMissCounter(int perfFd) {
+	long long misses = 0;
+
+	if (perfFd < 0) {
+		g_touchCacheMisses.store(-1);
+		return;
+	}
+
+	ioctl(perfFd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(perfFd, &misses, sizeof(misses)) == sizeof(misses)) {
+		g_touchCacheMisses.fetch_add(misses);
+	}
+	close(perfFd);
+}
+
+// Minor page faults of the process so far
+long long getMinorFaults() {
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return -1;
+	}
+
+	return usage.ru_minflt;
+}
+
 // VmRss (KB) from /proc/self/status
 long long getCurrentRSSkB() {
 	std::ifstream ifs("/proc/self/status");
@@ -59,14 +187,8 @@ long long getCurrentRSSkB() {
 	std::string line;
 	while (std::getline(ifs, line)) {
 		if (line.rfind("VmRSS:", 0) == 0) {
-			auto pos = line.find_last_of(" \t");
-
-			if (pos == std::string::npos) {
-				return -1;
-			}
-
-			std::string kbStr = line.substr(pos + 1);
-			return std::atoll(kbStr.c_str());
+			// "VmRSS:    1420 kB", atoll stops at the unit
+			return std::atoll(line.c_str() + strlen("VmRSS:"));
 		}
 	}
 
@@ -103,26 +225,33 @@ void metricsThreadFunc() {
 
 		// RSS
 		long long rssKB = getCurrentRSSkB();
+		long long minorFaults = getMinorFaults();
 
 		// bmslab
 		int page_count = 0;
 		int slot_count = 0;
+		int dirty_count = 0;
+		int purged_count = 0;
 		if (g_allocMode == AllocMode::BMSLAB && g_slab) {
 			page_count = get_bmslab_phys_page_count(g_slab);
 			slot_count = get_bmslab_allocated_slots(g_slab);
+			dirty_count = get_bmslab_dirty_page_count(g_slab);
+			purged_count = get_bmslab_purged_page_count(g_slab);
 		}
 
 		// 1) throughput.csv -> "timeSec, allocTPS, freeTPS"
 		g_throughputLog << sinceStartSec << "," << allocTPS << "."
 			<< freeTPS << "\n";
 
-		// 2) memory.csv -> "timeSec, rssKB"
-		g_memoryLog << sinceStartSec << "," << rssKB << "\n";
+		// 2) memory.csv -> "timeSec, rssKB, minorFaults"
+		g_memoryLog << sinceStartSec << "," << rssKB << "," << minorFaults
+			<< "\n";
 
 		// 3) bmslab.csv
 		if (g_allocMode == AllocMode::BMSLAB) {
 			g_bmslabLog << sinceStartSec << "," << page_count << ","
-				<< slot_count << "\n";
+				<< slot_count << "," << dirty_count << "," << purged_count
+				<< "\n";
 		}
 
 		// flush
@@ -152,7 +281,9 @@ void workerB1(int id) {
 			g_allocCount.fetch_add(1);
 
 			// free
-			if (g_allocMode == AllocMode::BMSLAB) {
+			if (g_allocMode == AllocMode::BMSLAB && g_freeAny) {
+				bmslab_free_any(ptr);
+			} else if (g_allocMode == AllocMode::BMSLAB) {
 				bmslab_free(g_slab, ptr);
 			} else {
 				free(ptr);
@@ -170,6 +301,16 @@ void workerB2(int id) {
 	localPtrs.reserve(g_chunkSize);
 
 	while (std::chrono::steady_clock::now() < endTime) {
+		if (g_allocMode == AllocMode::BMSLAB && g_bulk) {
+			localPtrs.resize(g_chunkSize);
+			int got = bmslab_alloc_bulk(g_slab, localPtrs.data(), g_chunkSize);
+			g_allocCount.fetch_add(got);
+
+			bmslab_free_bulk(g_slab, localPtrs.data(), got);
+			g_freeCount.fetch_add(got);
+			continue;
+		}
+
 		// alloc
 		localPtrs.clear();
 		for (int i = 0; i < g_chunkSize; i++) {
@@ -188,7 +329,9 @@ void workerB2(int id) {
 
 		// free
 		for (auto &ptr : localPtrs) {
-			if (g_allocMode == AllocMode::BMSLAB) {
+			if (g_allocMode == AllocMode::BMSLAB && g_freeAny) {
+				bmslab_free_any(ptr);
+			} else if (g_allocMode == AllocMode::BMSLAB) {
 				bmslab_free(g_slab, ptr);
 			} else {
 				free(ptr);
@@ -275,21 +418,400 @@ void workerB3(int id) {
 	}
 }
 
+// B=4, mixed sizes in [8, objSize]
+void workerB4(int id) {
+	auto endTime
+		= std::chrono::steady_clock::now() + std::chrono::seconds(g_runSeconds);
+	std::vector<void *> localPtrs;
+	localPtrs.reserve(g_chunkSize);
+	uint32_t rnd = 2463534242U + id;
+
+	while (std::chrono::steady_clock::now() < endTime) {
+		// alloc
+		localPtrs.clear();
+		for (int i = 0; i < g_chunkSize; i++) {
+			rnd ^= rnd << 13;
+			rnd ^= rnd >> 17;
+			rnd ^= rnd << 5;
+			size_t size = 8 + rnd % (g_objSize - 7);
+
+			void *ptr = NULL;
+			if (g_allocMode == AllocMode::BMSLAB) {
+				ptr = bmslab_multi_alloc(g_multi, size);
+			} else {
+				ptr = malloc(size);
+			}
+
+			if (ptr) {
+				localPtrs.push_back(ptr);
+				g_allocCount.fetch_add(1);
+			}
+		}
+
+		// free
+		for (auto &ptr : localPtrs) {
+			if (g_allocMode == AllocMode::BMSLAB) {
+				bmslab_multi_free(g_multi, ptr);
+			} else {
+				free(ptr);
+			}
+			g_freeCount.fetch_add(1);
+		}
+	}
+}
+
+// B=6, random touches over a working set of chunkSize objects per thread.
+// Run it under "perf stat -e dTLB-load-misses" to compare +huge with 4 KiB pages.
+// B=9 touches the first and the last word of each object instead of only the
+// first, so objects straddling two cache lines cost two misses (see +align).
+void workerB6(int id) {
+	auto endTime
+		= std::chrono::steady_clock::now() + std::chrono::seconds(g_runSeconds);
+	std::vector<void *> localPtrs(g_chunkSize);
+	uint32_t rnd = 2463534242U + id;
+
+	auto allocObj = [&]() -> void * {
+		void *ptr = NULL;
+		if (g_allocMode == AllocMode::BMSLAB) {
+			ptr = bmslab_alloc(g_slab);
+		} else {
+			ptr = malloc(g_objSize);
+		}
+
+		if (ptr) {
+			memset(ptr, 0, g_benchMode == 9 ? g_objSize : sizeof(uint64_t));
+			g_allocCount.fetch_add(1);
+		}
+		return ptr;
+	};
+
+	auto freeObj = [&](void *ptr) {
+		if (!ptr) {
+			return;
+		}
+
+		if (g_allocMode == AllocMode::BMSLAB) {
+			bmslab_free(g_slab, ptr);
+		} else {
+			free(ptr);
+		}
+		g_freeCount.fetch_add(1);
+	};
+
+	for (auto &ptr : localPtrs) {
+		ptr = allocObj();
+	}
+
+	// hardware cache misses of this thread, touch loop included
+	int perfFd = openCacheMissCounter();
+
+	while (std::chrono::steady_clock::now() < endTime) {
+		// touch
+		for (int i = 0; i < 1024; i++) {
+			rnd ^= rnd << 13;
+			rnd ^= rnd >> 17;
+			rnd ^= rnd << 5;
+
+			volatile uint64_t *word
+				= (volatile uint64_t *)localPtrs[rnd % g_chunkSize];
+			if (word) {
+				*word = *word + 1;
+			}
+			if (word && g_benchMode == 9) {
+				word = (volatile uint64_t *)((char *)word + g_objSize
+					- sizeof(uint64_t));
+				*word = *word + 1;
+			}
+		}
+		g_touchCount.fetch_add(1024);
+
+		// replace one object so the allocator stays in the loop
+		int idx = rnd % g_chunkSize;
+		freeObj(localPtrs[idx]);
+		localPtrs[idx] = allocObj();
+	}
+
+	closeCacheMissCounter(perfFd);
+
+	for (auto &ptr : localPtrs) {
+		freeObj(ptr);
+	}
+}
+
+// B=8, write to freshly allocated objects
+// Every thread allocates chunkSize objects, writes each of them 64 times and
+// frees them again. Objects of other threads in the same cache line turn
+// these writes into line transfers (false sharing).
+void workerB8(int id) {
+	std::vector<void *> localPtrs(g_chunkSize);
+	(void)id;
+
+	while (!g_stopFlag.load()) {
+		int got = 0;
+
+		if (g_allocMode == AllocMode::BMSLAB) {
+			for (int i = 0; i < g_chunkSize; i++) {
+				localPtrs[i] = bmslab_alloc(g_slab);
+				if (localPtrs[i]) {
+					got++;
+				}
+			}
+		} else {
+			for (int i = 0; i < g_chunkSize; i++) {
+				localPtrs[i] = malloc(g_objSize);
+				if (localPtrs[i]) {
+					got++;
+				}
+			}
+		}
+		g_allocCount.fetch_add(got);
+
+		for (int round = 0; round < 64; round++) {
+			for (int i = 0; i < g_chunkSize; i++) {
+				volatile uint64_t *word = (volatile uint64_t *)localPtrs[i];
+				if (word) {
+					*word = *word + 1;
+				}
+			}
+		}
+		g_touchCount.fetch_add((long long)got * 64);
+
+		for (int i = 0; i < g_chunkSize; i++) {
+			if (!localPtrs[i]) {
+				continue;
+			}
+
+			if (g_allocMode == AllocMode::BMSLAB) {
+				bmslab_free(g_slab, localPtrs[i]);
+			} else {
+				free(localPtrs[i]);
+			}
+		}
+		g_freeCount.fetch_add(got);
+	}
+}
+
+// B=10, stride over the first object of many pages
+// Every thread allocates chunkSize objects and keeps the lowest one of each
+// page. Without colouring these all sit at the same page offset and compete
+// for the same cache sets; pick an objSize that leaves tail space in a page
+// (e.g. 640) to compare +colour.
+void workerB10(int id) {
+	std::vector<void *> localPtrs;
+	std::vector<void *> pageFirst;
+	uintptr_t pageMask = ~(uintptr_t)(get_bmslab_page_size(g_slab) - 1);
+	(void)id;
+
+	localPtrs.reserve(g_chunkSize);
+	for (int i = 0; i < g_chunkSize; i++) {
+		void *ptr = bmslab_alloc(g_slab);
+		if (ptr) {
+			localPtrs.push_back(ptr);
+		}
+	}
+	g_allocCount.fetch_add(localPtrs.size());
+
+	std::vector<void *> sorted(localPtrs);
+	std::sort(sorted.begin(), sorted.end());
+	for (void *ptr : sorted) {
+		if (pageFirst.empty() || ((uintptr_t)pageFirst.back() & pageMask)
+				!= ((uintptr_t)ptr & pageMask)) {
+			pageFirst.push_back(ptr);
+		}
+	}
+
+	int perfFd = openCacheMissCounter();
+
+	while (!g_stopFlag.load() && !pageFirst.empty()) {
+		for (int round = 0; round < 64; round++) {
+			for (void *ptr : pageFirst) {
+				volatile uint64_t *word = (volatile uint64_t *)ptr;
+				*word = *word + 1;
+			}
+		}
+		g_touchCount.fetch_add((long long)pageFirst.size() * 64);
+	}
+
+	closeCacheMissCounter(perfFd);
+
+	for (void *ptr : localPtrs) {
+		bmslab_free(g_slab, ptr);
+	}
+	g_freeCount.fetch_add(localPtrs.size());
+}
+
+// B=12, random insert/erase on a per-thread map of about chunkSize entries
+// Each insert allocates a node and each erase frees one
+template <typename Map>
+void runMapChurn(Map &map, int id) {
+	auto endTime
+		= std::chrono::steady_clock::now() + std::chrono::seconds(g_runSeconds);
+	uint64_t x = 0x9E3779B97F4A7C15ULL * (id + 1);
+
+	while (std::chrono::steady_clock::now() < endTime) {
+		for (int i = 0; i < 1024; i++) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+
+			auto it = map.find(x % (2 * (uint64_t)g_chunkSize));
+			if (it == map.end()) {
+				map.emplace(x % (2 * (uint64_t)g_chunkSize), x);
+				g_allocCount.fetch_add(1);
+			} else {
+				map.erase(it);
+				g_freeCount.fetch_add(1);
+			}
+		}
+	}
+}
+
+// B=12, nodes from std::allocator (malloc), synchronized_pool_resource
+// (malloc+pmr), bmslabpp::allocator (bmslab) or bmslabpp::resource (bmslab+pmr)
+void workerB12(int id) {
+	using Value = std::pair<const uint64_t, uint64_t>;
+
+	if (g_pmr) {
+		std::pmr::map<uint64_t, uint64_t> map(g_mapResource.get());
+		runMapChurn(map, id);
+	} else if (g_allocMode == AllocMode::BMSLAB) {
+		std::map<uint64_t, uint64_t, std::less<uint64_t>,
+			bmslabpp::allocator<Value>> map{
+				bmslabpp::allocator<Value>(g_multi)};
+		runMapChurn(map, id);
+	} else {
+		std::map<uint64_t, uint64_t> map;
+		runMapChurn(map, id);
+	}
+}
+
+// B=7, B2 workload swept over 1, 2, 4, ... threadCount threads
+// Each step runs runSeconds, results go to scaling.csv
+void runScalingSweep() {
+	std::ofstream scalingLog("scaling.csv");
+	int threads = 1;
+
+	scalingLog << "Threads,AllocTPS,FreeTPS\n";
+
+	while (true) {
+		g_allocCount.store(0);
+		g_freeCount.store(0);
+
+		std::vector<std::thread> workers;
+		workers.reserve(threads);
+		for (int i = 0; i < threads; i++) {
+			workers.emplace_back(workerB2, i);
+		}
+		for (auto &th : workers) {
+			th.join();
+		}
+
+		double allocTPS = (double)g_allocCount.load() / g_runSeconds;
+		double freeTPS = (double)g_freeCount.load() / g_runSeconds;
+		scalingLog << threads << "," << allocTPS << "," << freeTPS << "\n";
+		std::cerr << "threads=" << threads << ", allocTPS=" << allocTPS
+			<< ", freeTPS=" << freeTPS << std::endl;
+
+		if (threads >= g_threadCount) {
+			break;
+		}
+		threads = std::min(threads * 2, g_threadCount);
+	}
+}
+
+// bmslab_config from the allocMode options
+void fillConfig(struct bmslab_config &config, int maxPageCount) {
+	config.obj_size = g_objSize;
+	config.max_page_count = maxPageCount;
+	config.huge_page = g_hugePage;
+	config.background_reclaim = g_backgroundReclaim;
+	config.decay_ms = g_decayMs;
+	config.purge_method = g_purgeMethod;
+	config.placement = g_homePlacement ?
+		BMSLAB_PLACEMENT_HOME : BMSLAB_PLACEMENT_HASH;
+	config.cacheline_layout = g_cachelineLayout;
+	config.slot_align = g_slotAlign;
+	config.colouring = g_colouring;
+}
+
+// B=11, bmslab_init_ex + bmslab_destroy for maxPageCount 1024, 2048, ... up to
+// maxPageCount. Each size is timed over runSeconds, results go to startup.csv
+int runStartupSweep() {
+	std::ofstream startupLog("startup.csv");
+	int pageCount = std::min(1024, g_maxPageCount);
+
+	startupLog << "MaxPageCount,InitUs,DestroyUs,RSSDelta_kB,MinorFaults\n";
+
+	while (true) {
+		struct bmslab_config config = {};
+		double initUs = 0, destroyUs = 0;
+		long long rssDelta = 0, faults = 0;
+		int rounds = 0;
+
+		fillConfig(config, pageCount);
+
+		auto endTime = std::chrono::steady_clock::now()
+			+ std::chrono::seconds(g_runSeconds);
+		do {
+			long long rssBefore = getCurrentRSSkB();
+			long long faultsBefore = getMinorFaults();
+			auto t0 = std::chrono::steady_clock::now();
+			bmslab_t *slab = bmslab_init_ex(&config);
+			auto t1 = std::chrono::steady_clock::now();
+
+			if (!slab) {
+				std::cerr << "Failed to init bmslab\n";
+				return 1;
+			}
+			rssDelta = std::max(rssDelta, getCurrentRSSkB() - rssBefore);
+			faults = std::max(faults, getMinorFaults() - faultsBefore);
+
+			bmslab_destroy(slab);
+			auto t2 = std::chrono::steady_clock::now();
+
+			initUs += std::chrono::duration<double, std::micro>(t1 - t0).count();
+			destroyUs
+				+= std::chrono::duration<double, std::micro>(t2 - t1).count();
+			rounds++;
+		} while (std::chrono::steady_clock::now() < endTime);
+
+		initUs /= rounds;
+		destroyUs /= rounds;
+		startupLog << pageCount << "," << initUs << "," << destroyUs << ","
+			<< rssDelta << "," << faults << "\n";
+		std::cerr << "maxPageCount=" << pageCount << ", initUs=" << initUs
+			<< ", destroyUs=" << destroyUs << ", rssDelta_kB=" << rssDelta
+			<< ", minorFaults=" << faults << std::endl;
+
+		if (pageCount >= g_maxPageCount) {
+			break;
+		}
+		pageCount = std::min(pageCount * 2, g_maxPageCount);
+	}
+
+	return 0;
+}
+
 int main(int argc, char *argv[]) {
 	// Arguments:
 	// 1) threadCount
 	// 2) runSeconds
-	// 3) benchMode=1|2|3
-	// 4) allocMode=malloc|bmslab
-	// 5) objSize
+	// 3) benchMode=1|2|3|4|5|6|7|8|9|10|11|12 (7: B2 swept up to threadCount,
+	//    10: bmslab only, 11: bmslab init time swept up to maxPageCount,
+	//    12: std::map churn)
+	// 4) allocMode=malloc|bmslab[+mag][+bulk][+huge][+bg][+decay][+dontneed]
+	//    [+home][+line][+align][+colour][+any][+pmr][+scalar|+sse2|+avx2|+avx512]
+	// 5) objSize (B=4: max size)
 	// 6) maxPageCount
 	// 7) chunkSize
 	// 8) phaseInterval
 	if (argc < 9) {
 		std::cerr << "Usage: " << argv[0]
-			<< " <threadCount> <runSeconds> <benchMode=1|2|3>"
-			<< " <allocMode=malloc|bmslab> <objSize> <maxPageCount>"
-			<< " <chunkSize> <phaseInterval>\n";
+			<< " <threadCount> <runSeconds> <benchMode=1|2|3|4|5|6|7|8|9|10|11|12>"
+			<< " <allocMode=malloc|bmslab[+mag][+bulk][+huge][+bg][+decay]"
+			<< "[+dontneed][+home][+line][+align][+colour][+any][+pmr]"
+			<< "[+scalar|+sse2|+avx2|+avx512]>"
+			<< " <objSize> <maxPageCount> <chunkSize> <phaseInterval>\n";
 		return 1;
 	}
 
@@ -303,31 +825,90 @@ int main(int argc, char *argv[]) {
 	g_chunkSize = std::stoi(argv[7]);
 	g_phaseInterval = std::stoi(argv[8]);
 
-	if (modeStr == "bmslab") {
+	if (parseAllocMode(modeStr) == "bmslab") {
 		g_allocMode = AllocMode::BMSLAB;
 	} else {
 		g_allocMode = AllocMode::MALLOC;
 	}
 
+	if ((g_benchMode == 10 || g_benchMode == 11)
+			&& g_allocMode != AllocMode::BMSLAB) {
+		std::cerr << "benchMode " << g_benchMode << " needs allocMode bmslab\n";
+		return 1;
+	}
+
+	if (g_benchMode == 11) {
+		if (bmslab_set_simd(g_simdLevel) != 0) {
+			std::cerr << "Unsupported SIMD level\n";
+			return 1;
+		}
+		return runStartupSweep();
+	}
+
 	g_throughputLog.open("throughput.csv");
 	g_memoryLog.open("memory.csv");
 	g_bmslabLog.open("bmslab.csv");
 	g_finalResult.open("final_result.csv");
 
 	g_throughputLog << "TimeSec,AllocTPS,FreeTPS\n";
-	g_memoryLog << "TimeSec,RSS_kB\n";
+	g_memoryLog << "TimeSec,RSS_kB,MinorFaults\n";
 	if (g_allocMode == AllocMode::BMSLAB) {
-		g_bmslabLog << "TimeSec,PhysPageCount,AllocatedSlots\n";
+		g_bmslabLog << "TimeSec,PhysPageCount,AllocatedSlots,DirtyPages,"
+			<< "PurgedPages\n";
 	}
 
-	if (g_allocMode == AllocMode::BMSLAB) {
-		g_slab = bmslab_init(g_objSize, g_maxPageCount);
+	if (g_allocMode == AllocMode::BMSLAB
+			&& (g_benchMode == 4 || g_benchMode == 12)) {
+		g_multi = bmslab_multi_init(NULL, 0, g_maxPageCount);
+		if (!g_multi) {
+			std::cerr << "Failed to init bmslab_multi\n";
+			return 1;
+		}
+		std::cerr << "bmslab_multi_init OK. maxSize=" << g_objSize
+			<< ", maxPageCount=" << g_maxPageCount << std::endl;
+		if (g_benchMode == 12 && g_pmr) {
+			g_mapResource = std::make_unique<bmslabpp::resource>(g_multi);
+		}
+	} else if (g_allocMode == AllocMode::BMSLAB) {
+		struct bmslab_config config = {};
+
+		if (bmslab_set_simd(g_simdLevel) != 0) {
+			std::cerr << "Unsupported SIMD level\n";
+			return 1;
+		}
+
+		fillConfig(config, g_maxPageCount);
+
+		g_slab = bmslab_init_ex(&config);
 		if (!g_slab) {
 			std::cerr << "Failed to init bmslab\n";
 			return 1;
 		}
+		if (g_magazineSize > 0
+				&& bmslab_enable_magazine(g_slab, g_magazineSize) != 0) {
+			std::cerr << "Failed to enable magazine\n";
+			return 1;
+		}
 		std::cerr << "bmslab_init OK. objSize=" << g_objSize
-			<< ", maxPageCount=" << g_maxPageCount << std::endl;
+			<< ", maxPageCount=" << g_maxPageCount
+			<< ", pageSize=" << get_bmslab_page_size(g_slab)
+			<< ", slotSize=" << get_bmslab_slot_size(g_slab)
+			<< ", slotsPerPage=" << get_bmslab_slot_count_per_page(g_slab)
+			<< ", submaps=" << get_bmslab_submap_count(g_slab)
+			<< ", colours=" << get_bmslab_colour_count(g_slab)
+			<< ", simd=" << get_bmslab_simd()
+			<< ", hugePageSize=" << get_bmslab_huge_page_size(g_slab)
+			<< ", magazineSize=" << g_magazineSize
+			<< ", backgroundReclaim=" << g_backgroundReclaim
+			<< ", decayMs=" << g_decayMs
+			<< ", purgeMethod=" << g_purgeMethod
+			<< ", homePlacement=" << g_homePlacement
+			<< ", cachelineLayout=" << g_cachelineLayout
+			<< ", freeAny=" << g_freeAny << std::endl;
+	}
+
+	if (g_benchMode == 12 && g_pmr && g_allocMode == AllocMode::MALLOC) {
+		g_mapResource = std::make_unique<std::pmr::synchronized_pool_resource>();
 	}
 
 	if (g_benchMode == 3) {
@@ -343,6 +924,34 @@ int main(int argc, char *argv[]) {
 								15000, g_chunkSize});
 	}
 
+	// B=5, B1 workload on a slab filled to 95% (every 20th object freed)
+	// Most submaps are full here, compare the submap scans with +scalar etc.
+	if (g_benchMode == 5 && g_allocMode == AllocMode::BMSLAB) {
+		std::vector<void *> chunk(1024);
+		int got;
+
+		while ((got = bmslab_alloc_bulk(g_slab, chunk.data(), 1024)) > 0) {
+			g_prefillPtrs.insert(g_prefillPtrs.end(),
+				chunk.begin(), chunk.begin() + got);
+		}
+
+		for (size_t i = 0; i < g_prefillPtrs.size(); i += 20) {
+			bmslab_free(g_slab, g_prefillPtrs[i]);
+		}
+
+		std::cerr << "prefill OK. allocatedSlots="
+			<< get_bmslab_allocated_slots(g_slab) << std::endl;
+	}
+
+	if (g_benchMode == 7) {
+		runScalingSweep();
+		if (g_slab) {
+			bmslab_destroy(g_slab);
+			g_slab = NULL;
+		}
+		return 0;
+	}
+
 	std::thread metricThread(metricsThreadFunc);
 
 	std::vector<std::thread> workers;
@@ -352,6 +961,18 @@ int main(int argc, char *argv[]) {
 			workers.emplace_back(workerB1, i);
 		} else if (g_benchMode == 2) {
 			workers.emplace_back(workerB2, i);
+		} else if (g_benchMode == 4) {
+			workers.emplace_back(workerB4, i);
+		} else if (g_benchMode == 5) {
+			workers.emplace_back(workerB1, i);
+		} else if (g_benchMode == 6 || g_benchMode == 9) {
+			workers.emplace_back(workerB6, i);
+		} else if (g_benchMode == 8) {
+			workers.emplace_back(workerB8, i);
+		} else if (g_benchMode == 10) {
+			workers.emplace_back(workerB10, i);
+		} else if (g_benchMode == 12) {
+			workers.emplace_back(workerB12, i);
 		} else {
 			workers.emplace_back(workerB3, i);
 		}
@@ -376,6 +997,7 @@ int main(int argc, char *argv[]) {
 	g_finalResult << "Duration: " << g_runSeconds << "\n";
 	g_finalResult << "BenchMode: " << g_benchMode << "\n";
 	g_finalResult << "AllocMode: " << modeStr << "\n";
+	g_finalResult << "MagazineSize: " << g_magazineSize << "\n";
 	g_finalResult << "ObjSize: " << g_objSize << "\n";
 	g_finalResult << "MaxPageCount: " << g_maxPageCount << "\n";
 	g_finalResult << "ChunkSize: " << g_chunkSize << "\n";
@@ -384,6 +1006,47 @@ int main(int argc, char *argv[]) {
 	g_finalResult << "TotalFrees: " << totalFrees << "\n";
 	g_finalResult << "AvgAllocTPS: " << avgAllocTPS << "\n";
 	g_finalResult << "AvgFreeTPS: " << avgFreeTPS << "\n";
+	g_finalResult << "MinorFaults: " << getMinorFaults() << "\n";
+	if (g_slab) {
+		g_finalResult << "CasFailures: " << get_bmslab_cas_failures(g_slab)
+			<< "\n";
+		g_finalResult << "FreeAny: " << g_freeAny << "\n";
+	}
+	if (g_slab) {
+		int slotSize = get_bmslab_slot_size(g_slab);
+
+		g_finalResult << "SimdLevel: " << get_bmslab_simd() << "\n";
+		g_finalResult << "SlotSize: " << slotSize << "\n";
+		g_finalResult << "SlotsPerPage: "
+			<< get_bmslab_slot_count_per_page(g_slab) << "\n";
+		g_finalResult << "SubmapCount: " << get_bmslab_submap_count(g_slab)
+			<< "\n";
+		g_finalResult << "SlotOverheadPercent: "
+			<< 100.0 * (slotSize - g_objSize) / slotSize << "\n";
+	}
+	if (g_benchMode == 10) {
+		g_finalResult << "Colours: " << get_bmslab_colour_count(g_slab) << "\n";
+		g_finalResult << "TotalTouches: " << g_touchCount.load() << "\n";
+		g_finalResult << "AvgTouchTPS: "
+			<< (double)g_touchCount.load() / g_runSeconds << "\n";
+		g_finalResult << "TouchCacheMisses: " << g_touchCacheMisses.load()
+			<< "\n";
+	}
+	if (g_benchMode == 6 || g_benchMode == 9) {
+		g_finalResult << "HugePage: " << (g_hugePage ? 1 : 0) << "\n";
+		g_finalResult << "TotalTouches: " << g_touchCount.load() << "\n";
+		g_finalResult << "AvgTouchTPS: "
+			<< (double)g_touchCount.load() / g_runSeconds << "\n";
+		g_finalResult << "TouchCacheMisses: " << g_touchCacheMisses.load()
+			<< "\n";
+	}
+	if (g_benchMode == 8) {
+		g_finalResult << "CachelineLayout: " << (g_cachelineLayout ? 1 : 0)
+			<< "\n";
+		g_finalResult << "TotalWrites: " << g_touchCount.load() << "\n";
+		g_finalResult << "AvgWriteTPS: "
+			<< (double)g_touchCount.load() / g_runSeconds << "\n";
+	}
 
 	// Close files
 	g_throughputLog.close();
@@ -396,5 +1059,10 @@ int main(int argc, char *argv[]) {
 		g_slab = NULL;
 	}
 
+	if (g_multi) {
+		bmslab_multi_destroy(g_multi);
+		g_multi = NULL;
+	}
+
 	return 0;
 }
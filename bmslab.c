@@ -10,21 +10,86 @@
  * 1. Memory Management:
  *    - Memory is allocated in pages using mmap.
  *    - Each page is divided into a number of fixed-size slots, determined by PAGE_SIZE
- *      divided by the object size (obj_size), with a maximum of 512 slots per page.
+ *      divided by the object size (obj_size), with a maximum of 1024 slots per page.
+ *    - The slab page size can also be configured (4 KiB ~ 256 KiB), e.g. to get
+ *      more than 512 small slots per page.
+ *    - With slot_align, slots are padded so that none crosses an alignment
+ *      boundary (e.g. a 64-byte cache line), at the cost of fewer slots.
+ *    - With colouring, the unused tail of each page moves its slot 0 by a
+ *      rotating number of cache lines, so hot slots of different pages do not
+ *      compete for the same cache sets.
+ *    - Objects larger than PAGE_SIZE use span mode, where a slab page is a span of
+ *      2^n contiguous pages chosen to keep the tail waste small. Everything that
+ *      works per page below (bitmaps, page_locks, expand/shrink) then works
+ *      per span.
+ *    - bmslab_init_hugepage() backs the region with 2 MiB pages, using hugetlbfs
+ *      when pages are reserved and transparent huge pages otherwise. A huge page
+ *      is only given back once every slab page inside it has been purged.
+ *    - Slab mappings are aligned to and sized in 2 MiB regions, which are
+ *      recorded in a process-wide two-level table, so bmslab_owner() and
+ *      bmslab_free_any() find the slab of a pointer without a handle or lock.
  *
  * 2. Bitmap Tracking:
- *    - Each page contains 16 submaps (arrays of 32-bit integers), where each bit
- *      represents a slot (0 indicates free, 1 indicates used).
+ *    - Each page contains 1 ~ 16 submaps (64-bit integers), where each bit
+ *      represents a slot (0 indicates free, 1 indicates used). The submap count
+ *      is chosen per slab so that a submap covers at most 32 slots unless the
+ *      page has more than 512, so pages of large objects scan a single word.
+ *    - A 16-bit mask per page marks its non-full submaps, and a two-level summary
+ *      bitmap marks the pages that have non-full submaps. Allocation finds a
+ *      candidate page and submap with a few ctz operations instead of probing.
+ *    - The non-full submaps of a candidate page come from its 16-bit non-full
+ *      mask. On x86, bmslab_set_simd() can instead compare the bitmap lines
+ *      against all-ones with SSE2, AVX2 or AVX-512; the mask is kept for the
+ *      page summary either way, so the scalar read is the default.
+ *    - Slots are dealt to the submaps round-robin, one at a time by default. With
+ *      cacheline_layout, a whole cache line of small slots goes to one submap,
+ *      so that objects of different threads do not share a line.
  *
  * 3. Dynamic Physical Page Expansion and Shrinkage:
- *    - When the allocated slot count exceeds a predefined threshold (PAGE_EXPAND_THRESHOLD),
- *      adaptive_phys_page_expand() adds a new physical page.
+ *    - When the allocated slot count exceeds a threshold (PAGE_EXPAND_THRESHOLD),
+ *      adaptive_phys_page_expand() adds physical pages, one by default or as many
+ *      as the configured growth policy asks for.
+ *    - The bitmaps, locks and non-full masks live in a lazily faulted mapping,
+ *      and a page's entries are only written when it is first brought online,
+ *      so bmslab_init_ex() costs the same for any max_page_count.
  *    - When usage drops below a threshold (PAGE_SHRINK_THRESHOLD), adaptive_phys_page_shrink()
- *      attempts to free the last physical page.
+ *      purges one empty page, wherever it is. Pages are tracked as empty when a
+ *      free leaves their bitmap without allocated slots, and purged pages are
+ *      reused before the slab grows into new pages.
+ *    - Pages carry no reference count. The shrinker sets the page's lock and then
+ *      checks that the bitmap is empty, while an allocator checks the lock after
+ *      its claim and gives the slot back if the page got locked. Probing a page
+ *      is read-only; only a successful claim writes shared memory.
+ *    - Thresholds, growth, minimum resident pages and the purge advice can be set
+ *      per slab through bmslab_init_ex().
+ *    - The page limit can be moved at runtime with bmslab_set_limit(), within
+ *      the address range reserved at init (reserve_page_count), so a slab need
+ *      not be sized for its worst-case spike. Objects never move, so a pointer
+ *      still maps to its page with one shift.
+ *    - With decay_ms set, shrinking ignores the usage threshold. Pages that became
+ *      empty stay resident and are purged gradually along a smoothstep curve over
+ *      decay_ms, as in jemalloc, so oscillating workloads do not refault pages.
+ *    - Slabs created with background_reclaim never shrink in the free path. One
+ *      reclaimer thread per process wakes up periodically and shrinks all of
+ *      them, so madvise stays out of bmslab_free().
  *
  * 4. Randomized Allocation:
  *    - The allocator uses a variant of the MurmurHash3 (murmurhash32) to distribute
  *      allocation attempts across pages and submaps, reducing contention.
+ *    - With BMSLAB_PLACEMENT_HOME, each thread instead allocates sequentially
+ *      from a home page and only moves to another page (which then becomes its
+ *      home) when the home page is full, keeping a thread's objects together.
+ *
+ * 5. Per-thread Magazines (optional):
+ *    - When enabled with bmslab_enable_magazine(), each thread keeps a bounded
+ *      stack of free objects per slab, so most bmslab_alloc()/bmslab_free()
+ *      calls are served with plain loads and stores. Magazines are drained when
+ *      the thread exits and are detached when the slab is destroyed.
+ *
+ * 6. Size Classes:
+ *    - bmslab_multi owns one slab per size class. Allocation sizes are mapped
+ *      to classes by a lookup table, and frees are routed to the owning slab
+ *      by a binary search over the slabs' address ranges.
  */
 
 #define _GNU_SOURCE
@@ -35,10 +100,18 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #include <string.h>
 #include <assert.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BMSLAB_X86
+#endif
+
 #include "bmslab.h"
 
 #ifndef __cacheline_aligned
@@ -48,489 +121,3425 @@
 #define PAGE_SIZE	(4096)
 #define PAGE_SHIFT	(12)
 
-#define PAGE_EXPAND_THRESHOLD(max_page_cnt) (max_page_cnt >> 1)
-#define PAGE_SHRINK_THRESHOLD(max_page_cnt) (max_page_cnt >> 3)
+#define SPAN_MAX_SHIFT	(18)
+
+#define HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+#define HUGE_PAGE_SHIFT	(21)
+#define MAX_OBJ_SIZE	(64 * 1024)
+
+/*
+ * Address registry. Slab mappings are aligned to and sized in 2 MiB regions,
+ * so a region belongs to at most one slab. A 47-bit address is split into a
+ * root index, a leaf index and the offset within the region: 4096 root entries
+ * (32 KiB) of 16384-entry leaves (128 KiB each) cover 2^47 bytes.
+ */
+#define REGION_SHIFT		(HUGE_PAGE_SHIFT)
+#define REGION_SIZE			(1UL << REGION_SHIFT)
+#define REGISTRY_ADDR_BITS	(47)
+#define REGISTRY_LEAF_BITS	(14)
+#define REGISTRY_ROOT_BITS	(REGISTRY_ADDR_BITS - REGION_SHIFT - REGISTRY_LEAF_BITS)
+
+/* Thresholds are kept as fractions of 1 << THRESHOLD_SHIFT */
+#define THRESHOLD_SHIFT (10)
+#define DEFAULT_EXPAND_RATIO (1U << (THRESHOLD_SHIFT - 1))	/* 50% */
+#define DEFAULT_SHRINK_RATIO (1U << (THRESHOLD_SHIFT - 3))	/* 12.5% */
+
+#define PAGE_EXPAND_THRESHOLD(slab, max_slot_cnt) \
+	(((uint64_t)(max_slot_cnt) * (slab)->expand_ratio) >> THRESHOLD_SHIFT)
+#define PAGE_SHRINK_THRESHOLD(slab, max_slot_cnt) \
+	(((uint64_t)(max_slot_cnt) * (slab)->shrink_ratio) >> THRESHOLD_SHIFT)
+
+
+#define SUBMAP_MAX_COUNT (16)
+#define SUBMAP_BITS (64)
+#define SUBMAP_FULL (~0ULL)
+#define SUBMAP_LINE_COUNT (8) /* 64-bit submaps per cache line */
+#define MAX_SLOT_COUNT (SUBMAP_MAX_COUNT * SUBMAP_BITS)
+
+#define CACHELINE_SHIFT (6)
+
+#define SUMMARY_SHIFT (6) /* 64 bits per summary word */
+
+#define MAGAZINE_MAX_SIZE (1024)
+
+#define SLOT_COUNTER_SHARD_COUNT (16)
+#define SLOT_COUNTER_BATCH (8)
+
+#define HOME_CACHE_SIZE (8)
 
-#define PAGE_LOCK_MASK (0x8000000000000000ULL)
-#define IS_PAGE_LOCKED(page_lock_ref) ((page_lock_ref) & PAGE_LOCK_MASK)
+#define DEFAULT_RECLAIM_INTERVAL_MS (100)
 
-#define SUBMAP_COUNT (16)
+#define DECAY_EPOCH_SHIFT (5)
+#define DECAY_EPOCH_COUNT (1U << DECAY_EPOCH_SHIFT)
+
+#define BULK_FREE_PAGE_COUNT (8)
+
+#define MULTI_MAX_CLASS_COUNT (64)
+#define MULTI_CLASS_SHIFT (3)
 
 _Thread_local static uint32_t tls_murmur_seed = 0;
 
+/* Threads are numbered in the order they first touch a slab */
+static _Atomic uint32_t thread_seq = 0;
+_Thread_local static uint32_t tls_thread_seq = 0; /* sequence + 1 */
+
 /*
- * bmslab_bitmap - per-page bitmap
- * @submap: 16 arrays of 32-bit bitmaps (each = 4 bytes)
+ * bmslab_bitmap - one cache line of a page's bitmap
+ * @submap: 8 64-bit submaps (bit=0 => free, bit=1 => used)
  *
- * Each page has 16 submaps, each submap covers 32 slots
- * (bit=0 => free, bit=1 => used).
+ * A page has slab->submap_count submaps (1 ~ 16) and uses one line, or two
+ * with 16 submaps. The geometry is chosen per slab so that a submap covers at
+ * most 32 slots while the page has no more than 512, and up to 64 slots for
+ * larger pages. Unused submaps of the line are kept full.
  *
- * Total capacity per page = 16 * 32 = 512 slots (max).
+ * Total capacity per page = 16 * 64 = 1024 slots (max).
  */
 struct bmslab_bitmap {
-	_Atomic uint32_t submap[SUBMAP_COUNT];
+	_Atomic uint64_t submap[SUBMAP_LINE_COUNT];
+} __cacheline_aligned;
+
+/*
+ * bmslab_page_lock - lock of a page
+ * @locked: 1 while the shrinker examines the page or while it is purged
+ *
+ * Padded to a cache line like bmslab_bitmap, so that locking one page does not
+ * invalidate the lines that allocators read for neighbouring pages.
+ */
+struct bmslab_page_lock {
+	_Atomic uint32_t locked;
 } __cacheline_aligned;
 
+/*
+ * bmslab_counter_shard - one shard of the allocated slot counter
+ * @delta: allocations minus frees of this shard's threads, not yet folded into
+ *         slab->allocated_slot_count
+ * @cas_failures: failed claim CAS operations of this shard's threads
+ */
+struct bmslab_counter_shard {
+	_Atomic int32_t delta;
+	_Atomic uint64_t cas_failures;
+} __cacheline_aligned;
+
+/*
+ * bmslab_home - home position of the calling thread in one slab
+ * @slab: slab the entry belongs to, NULL if unused
+ * @page_idx: page the thread allocates from
+ * @submap_idx: submap of the next allocation
+ * @hash: hash of the thread's sequence number, spreads homes and steals
+ * @page_count: usable page count the home page was picked from
+ *
+ * Kept in a small direct-mapped thread-local cache indexed by the slab address.
+ * An entry evicted by another slab is simply assigned again.
+ */
+struct bmslab_home {
+	struct bmslab *slab;
+	uint32_t page_idx;
+	uint32_t submap_idx;
+	uint32_t hash;
+	uint32_t page_count;
+};
+
+_Thread_local static struct bmslab_home tls_homes[HOME_CACHE_SIZE];
+
+/*
+ * bmslab_magazine - per-thread, per-slab cache of free objects
+ * @slab: owning slab, NULL once the slab has been destroyed
+ * @slab_next: next magazine of the same slab
+ * @slab_pprev: link that points to this magazine in the slab's list
+ * @thread_next: next magazine owned by the same thread
+ * @count: number of cached objects
+ * @capacity: maximum number of cached objects
+ * @objs: stack of cached objects
+ *
+ * Only the owner thread touches @count and @objs. The list links and @slab are
+ * modified under magazine_lock, which serializes thread exit against
+ * bmslab_destroy().
+ */
+struct bmslab_magazine {
+	_Atomic(struct bmslab *) slab;
+	struct bmslab_magazine *slab_next;
+	struct bmslab_magazine **slab_pprev;
+	struct bmslab_magazine *thread_next;
+	uint32_t count;
+	uint32_t capacity;
+	void *objs[];
+};
+
+/*
+ * Root of the address registry. Leaves are allocated on first use and never
+ * freed, so a lookup is two dependent loads without any lock.
+ */
+struct bmslab_registry_leaf {
+	_Atomic(struct bmslab *) slabs[1 << REGISTRY_LEAF_BITS];
+};
+
+static _Atomic(struct bmslab_registry_leaf *) registry[1 << REGISTRY_ROOT_BITS];
+
+static pthread_mutex_t magazine_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t magazine_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t magazine_key;
+
+_Thread_local static struct bmslab_magazine *tls_magazines = NULL;
+_Thread_local static struct bmslab_magazine *tls_last_magazine = NULL;
+
+/*
+ * Background reclaimer, shared by all slabs created with background_reclaim.
+ * The thread is started with the first such slab and then stays, sleeping on
+ * reclaimer_cond while no slab is registered. reclaimer_lock protects the slab
+ * list, so bmslab_destroy() cannot race with a shrink pass.
+ */
+static pthread_mutex_t reclaimer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaimer_cond = PTHREAD_COND_INITIALIZER;
+static struct bmslab *reclaimer_slabs = NULL;
+static bool reclaimer_started = false;
+static uint32_t reclaimer_interval_ms = DEFAULT_RECLAIM_INTERVAL_MS;
+
+/*
+ * Non-full submap search, scalar unless bmslab_set_simd() selects a vector one.
+ * Returns a mask of the page's submaps that had a free bit.
+ */
+typedef uint32_t (*submap_scan_fn)(struct bmslab *slab, uint32_t page_idx);
+
+static pthread_once_t submap_scan_once = PTHREAD_ONCE_INIT;
+static _Atomic(submap_scan_fn) submap_scan = NULL;
+static _Atomic int submap_scan_level = BMSLAB_SIMD_SCALAR;
+
+/*
+ * Every live slab, so that the fork handlers can reach each slab's
+ * phys_page_count_flag. The handlers are registered with the first slab.
+ */
+static pthread_mutex_t slab_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bmslab *slab_list = NULL;
+static _Atomic bool fork_handlers_registered = false;
+
 /*
  * bmslab - top-level structure
- * @page_lock_refs: array of lock bit and reference count for each page
- * @allocated_slot_count: global count of allocated slots
+ * @page_locks: lock of each page, one per line
+ * @allocated_slot_count: folded part of the allocated slot count
+ * @slot_count_shards: per-thread-group deltas of the allocated slot count
  * @phys_page_count_flag: flag to enable only one thread to control page count
- * @phys_page_count: number of physical pages
- * @virt_page_count: number of virtual pages
+ * @phys_page_count: number of pages brought online, purged ones included
+ * @online_gen: advanced whenever pages become usable, new or reused, so that
+ *              an allocation pass can tell whether it missed any
+ * @purged_page_count: number of purged pages below phys_page_count
+ * @empty_page_count: number of bits set in empty_pages
+ * @virt_page_count: number of virtual pages reserved at init
+ * @page_limit: pages the slab may use, at most virt_page_count
  * @slot_count_per_page: number of valid slots per page
+ * @slot_group_shift: log2 of the consecutive slots that share a submap
+ * @submap_count: number of submaps of a page, a power of two
+ * @submap_shift: log2 of submap_count
+ * @bitmap_line_count: bitmap lines per page
+ * @colour_mask: page index bits that select the colour of a page
+ * @colour_shift: log2 of the distance between two colours
  * @obj_size: size of each object
+ * @slot_size: distance between slots, obj_size rounded up for slot_align
+ * @page_shift: log2 of the slab page size, PAGE_SHIFT unless in span mode
+ * @page_size: size of a slab page (span)
  * @base_addr: base address of the contiguos pages
- * @bitmaps: array of bmslab_bitmap, each describing one page's submaps
+ * @map_size: size of the mapping at base_addr
+ * @huge_page: true if the mapping is backed by 2 MiB pages
+ * @purge_advice: madvise advice used to release purged pages
+ * @expand_ratio: expand threshold, in 1/1024 of the resident slots
+ * @shrink_ratio: shrink threshold, in 1/1024 of the resident slots
+ * @growth: one of enum bmslab_growth
+ * @growth_step: pages (fixed) or percent of resident pages (proportional)
+ * @min_resident_pages: resident pages never purged by the shrinker
+ * @shrink_hysteresis: empty pages kept resident before the shrinker purges one
+ * @background_reclaim: shrink only from the reclaimer thread
+ * @placement: one of enum bmslab_placement
+ * @decay_ms: time over which empty pages are purged, 0 to purge by threshold
+ * @decay_epoch_ns: length of one decay epoch
+ * @decay_epoch_start: start time of the current decay epoch
+ * @decay_dirty_count: empty_page_count at the end of the last decay purge
+ * @decay_backlog: pages that became empty in each of the last epochs
+ * @reclaim_next: next slab registered to the reclaimer
+ * @list_next: next slab in slab_list
+ * @list_pprev: link that points to this slab in slab_list, NULL if unlinked
+ * @bitmaps: array of bmslab_bitmap, bitmap_line_count lines per page
+ * @nonfull_submaps: mask of the submaps that have free slots, for each page
+ * @page_summary: one bit per page, set if its nonfull_submaps is not empty
+ * @page_summary_top: one bit per page_summary word, set if the word is not zero
+ * @empty_submaps: value of each submap when it has no allocated slot
+ * @empty_nonfull: nonfull_submaps of a page that has no allocated slot
+ * @meta_addr: mapping that holds bitmaps, page_locks and nonfull_submaps
+ * @meta_size: size of the mapping at meta_addr
+ * @empty_pages: one bit per page, set when a free left it without objects
+ * @purged_pages: one bit per page, set while the page is purged and locked
+ * @reclaim_cursor: page index where the next search for an empty page starts
+ * @magazine_size: capacity of per-thread magazines, 0 if disabled
+ * @magazines: list of magazines created for this slab
  */
 struct bmslab {
-	_Atomic uint64_t *page_lock_refs;
-	_Atomic uint32_t allocated_slot_count;
+	struct bmslab_page_lock *page_locks;
+	_Atomic int32_t allocated_slot_count;
+	struct bmslab_counter_shard *slot_count_shards;
 	_Atomic uint32_t phys_page_count_flag;
 	_Atomic uint32_t phys_page_count;
+	_Atomic uint32_t online_gen;
+	_Atomic uint32_t purged_page_count;
+	_Atomic uint32_t empty_page_count;
 	uint32_t virt_page_count;
+	_Atomic uint32_t page_limit;
 	uint32_t slot_count_per_page;
+	uint32_t slot_group_shift;
+	uint32_t submap_count;
+	uint32_t submap_shift;
+	uint32_t bitmap_line_count;
+	uint32_t colour_mask;
+	uint32_t colour_shift;
 	uint32_t obj_size;
+	uint32_t slot_size;
+	uint32_t page_shift;
+	uint32_t page_size;
 	void *base_addr;
+	size_t map_size;
+	bool huge_page;
+	int purge_advice;
+	uint32_t expand_ratio;
+	uint32_t shrink_ratio;
+	uint32_t growth;
+	uint32_t growth_step;
+	uint32_t min_resident_pages;
+	uint32_t shrink_hysteresis;
+	bool background_reclaim;
+	int placement;
+	uint32_t decay_ms;
+	uint64_t decay_epoch_ns;
+	_Atomic uint64_t decay_epoch_start;
+	uint32_t decay_dirty_count;
+	uint32_t decay_backlog[DECAY_EPOCH_COUNT];
+	struct bmslab *reclaim_next;
+	struct bmslab *list_next;
+	struct bmslab **list_pprev;
 	struct bmslab_bitmap *bitmaps;
+	_Atomic uint16_t *nonfull_submaps;
+	_Atomic uint64_t *page_summary;
+	_Atomic uint64_t *page_summary_top;
+	uint64_t empty_submaps[SUBMAP_MAX_COUNT];
+	uint16_t empty_nonfull;
+	void *meta_addr;
+	size_t meta_size;
+	_Atomic uint64_t *empty_pages;
+	_Atomic uint64_t *purged_pages;
+	uint32_t reclaim_cursor;
+	uint32_t magazine_size;
+	struct bmslab_magazine *magazines;
 };
 
-int get_bmslab_phys_page_count(struct bmslab *slab)
+static void *__bmslab_alloc(struct bmslab *slab);
+static void __bmslab_free(struct bmslab *slab, void *ptr);
+static int __bmslab_alloc_bulk(struct bmslab *slab, void **out, int n);
+static void __bmslab_free_bulk(struct bmslab *slab, void **ptrs, int n);
+static int reclaimer_register(struct bmslab *slab);
+static void reclaimer_unregister(struct bmslab *slab);
+static void submap_scan_init(void);
+static void magazine_key_init(void);
+static void register_fork_handlers(void);
+static void init_page(struct bmslab *slab, uint32_t page_idx);
+
+/* Submaps of a page */
+static inline _Atomic uint64_t *page_submaps(struct bmslab *slab,
+	uint32_t page_idx)
 {
-	return atomic_load(&slab->phys_page_count_flag);
+	return slab->bitmaps[page_idx * slab->bitmap_line_count].submap;
 }
 
-int get_bmslab_allocated_slots(struct bmslab *slab)
+/*
+ * slot_index - slot of a submap bit
+ * @slab: pointer to bmslab
+ * @submap_idx: submap index
+ * @bit_idx: bit index within the submap
+ *
+ * Slots are dealt to the submaps round-robin in groups of 1 << slot_group_shift
+ * consecutive slots. With the default group of one slot, neighbouring slots
+ * belong to different submaps (slot = bit * submap_count + submap). The cache-line
+ * layout uses groups that cover a cache line, so that a line of small objects
+ * is claimed through a single submap.
+ */
+static inline uint32_t slot_index(struct bmslab *slab, uint32_t submap_idx,
+	uint32_t bit_idx)
 {
-	return atomic_load(&slab->allocated_slot_count);
+	uint32_t shift = slab->slot_group_shift;
+	uint32_t group_mask = (1U << shift) - 1;
+
+	return ((bit_idx & ~group_mask) << slab->submap_shift)
+		| (submap_idx << shift) | (bit_idx & group_mask);
 }
 
 /*
- * bmslab_init - initializes a bmslab
- * @obj_size: size of each object (must be >= 8 and <= PAGE_SIZE)
- * @phys_page_count: number of pages to allocate
- *
- * Returns pointer to a bmslab on sucess, or NULL on failure.
- *
- * We compute how many slots actually fit (PAGE_SIZE / obj_siz), capped at 512.
- * Then we mark only those bits as (0 => free), the rest as (1 => unavailable)
- * for simple exception handling.
+ * slot_position - inverse of slot_index()
  */
-struct bmslab *bmslab_init(int obj_size, int max_page_count)
+static inline void slot_position(struct bmslab *slab, uint32_t slot_idx,
+	uint32_t *submap_idx, uint32_t *bit_idx)
 {
-	int submap_idx, bit_idx;
-	uint32_t mask, oldv;
-	struct bmslab *slab;
+	uint32_t shift = slab->slot_group_shift;
+	uint32_t group_mask = (1U << shift) - 1;
 
-	if (obj_size < 8 || obj_size > PAGE_SIZE) {
-		fprintf(stderr, "bmslab_init: invalid obj_size\n");
-		return NULL;
-	}
+	*submap_idx = (slot_idx >> shift) & (slab->submap_count - 1);
+	*bit_idx = ((slot_idx >> slab->submap_shift) & ~group_mask)
+		| (slot_idx & group_mask);
+}
 
-	if (max_page_count == 0) {
-		fprintf(stderr, "bmslab_init: invalid max_page_count\n");
-		return NULL;
-	}
+/*
+ * get_thread_seq - sequence number of the calling thread
+ *
+ * Threads are numbered on first use. The number selects the counter shard and
+ * the initial home page of the thread.
+ */
+static inline uint32_t get_thread_seq(void)
+{
+	if (tls_thread_seq == 0)
+		tls_thread_seq = atomic_fetch_add(&thread_seq, 1U) + 1;
 
-	slab = calloc(1, sizeof(struct bmslab));
-	if (slab == NULL) {
-		fprintf(stderr, "bmslab_init: slab allocation failed\n");
-		return NULL;
-	}
+	return tls_thread_seq - 1;
+}
 
-	atomic_store(&slab->phys_page_count_flag, 0);
-	atomic_store(&slab->virt_page_count, max_page_count);
-	atomic_store(&slab->phys_page_count, 1); /* initial page usage */
-	atomic_store(&slab->allocated_slot_count, 0);
+static inline struct bmslab_counter_shard *get_counter_shard(
+	struct bmslab *slab)
+{
+	return &slab->slot_count_shards[get_thread_seq() % SLOT_COUNTER_SHARD_COUNT];
+}
 
-	slab->obj_size = obj_size;
-	slab->slot_count_per_page = PAGE_SIZE / obj_size;
+/*
+ * add_slot_count - add to the allocated slot count
+ * @slab: pointer to bmslab
+ * @count: number of allocated (positive) or freed (negative) slots
+ *
+ * The count goes to the shard of the calling thread, which is folded into
+ * slab->allocated_slot_count once it drifts SLOT_COUNTER_BATCH away from zero.
+ * So threads of different shards do not share a cache line here, and the
+ * folded count is off by at most about SLOT_COUNTER_SHARD_COUNT *
+ * SLOT_COUNTER_BATCH slots.
+ */
+static inline void add_slot_count(struct bmslab *slab, int32_t count)
+{
+	struct bmslab_counter_shard *shard = get_counter_shard(slab);
+	int32_t delta;
 
-	slab->bitmaps = calloc(slab->virt_page_count, sizeof(struct bmslab_bitmap));
-	if (slab->bitmaps == NULL) {
-		fprintf(stderr, "bmslab_init: slab->bitmaps allocation failed\n");
-		free(slab);
-		return NULL;
-	}
+	delta = atomic_fetch_add(&shard->delta, count) + count;
 
-	slab->page_lock_refs = calloc(slab->virt_page_count, sizeof(uint64_t));
-	if (slab->page_lock_refs == NULL) {
-		fprintf(stderr, "bmslab_init: slab->page_lock_refs allocation failed\n");
-		free(slab->bitmaps);
-		free(slab);
-		return NULL;
+	if (delta >= SLOT_COUNTER_BATCH || delta <= -SLOT_COUNTER_BATCH) {
+		atomic_fetch_add(&slab->allocated_slot_count,
+			atomic_exchange(&shard->delta, 0));
 	}
+}
 
-	slab->base_addr = mmap(NULL, slab->virt_page_count * PAGE_SIZE,
-		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (slab->base_addr == MAP_FAILED) {
-		fprintf(stderr, "bmslab_init: slab->base_addr allocation failed\n");
-		free(slab->bitmaps);
-		free(slab->page_lock_refs);
-		free(slab);
-		return NULL;
-	}
+static inline void count_cas_failure(struct bmslab *slab)
+{
+	atomic_fetch_add_explicit(&get_counter_shard(slab)->cas_failures, 1,
+		memory_order_relaxed);
+}
 
-	/* Initialize each page's submaps */
-	for (uint32_t page_idx = 0; page_idx < slab->virt_page_count; page_idx++) {
-		for (uint32_t i = 0; i < SUBMAP_COUNT; i++) {
-			atomic_init(&slab->bitmaps[page_idx].submap[i], 0xffffffffU);
-		}
+/*
+ * get_approx_slot_count - allocated slot count for expand/shrink decisions
+ * @slab: pointer to bmslab
+ *
+ * Only reads the folded count, see add_slot_count() for the error bound.
+ */
+static inline uint32_t get_approx_slot_count(struct bmslab *slab)
+{
+	int32_t slot_count = atomic_load(&slab->allocated_slot_count);
 
-		/* Distribute slots across the submaps */
-		for (uint32_t s = 0; s < slab->slot_count_per_page; s++) {
-			submap_idx = s % SUBMAP_COUNT;
-			bit_idx = s / SUBMAP_COUNT;
-			
-			mask = ~(1U << bit_idx);
-			oldv = atomic_load(&slab->bitmaps[page_idx].submap[submap_idx]);
+	return slot_count > 0 ? (uint32_t)slot_count : 0;
+}
 
-			atomic_store(&slab->bitmaps[page_idx].submap[submap_idx],
-				oldv & mask);
-		}
-	}
+static inline uint64_t get_time_ns(void)
+{
+	struct timespec ts;
 
-	return slab;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-/*
- * bmslab_destroy - fress the bmslab
- * @slab: pointer to bmslab
- */
-void bmslab_destroy(struct bmslab *slab)
+int get_bmslab_phys_page_count(struct bmslab *slab)
 {
-	if (slab == NULL)
-		return;
+	return atomic_load(&slab->phys_page_count)
+		- atomic_load(&slab->purged_page_count);
+}
 
-	free(slab->page_lock_refs);
-	free(slab->bitmaps);
-	munmap(slab->base_addr, slab->virt_page_count * PAGE_SIZE);
-	free(slab);
+int get_bmslab_page_limit(struct bmslab *slab)
+{
+	return atomic_load(&slab->page_limit);
 }
 
-/*
- * murmurhash32 - small MurmurHash3 variant for 32-bit output
- * @key: pointer to data to be hashed
- * @len: length of the data (in bytes)
- * @seed: initial seed value
- */
-static inline uint32_t murmurhash32(const void *key, size_t len, uint32_t seed)
+int get_bmslab_allocated_slots(struct bmslab *slab)
 {
-	const uint8_t *data = (const uint8_t *)key;
-	uint32_t h = seed;
-	const uint32_t c1 = 0xcc9e2d51;
-	const uint32_t c2 = 0x1b873593;
-	size_t i;
+	int32_t slot_count = atomic_load(&slab->allocated_slot_count);
 
-	for (i = 0; i + 4 <= len; i += 4) {
-		uint32_t k;
-		memcpy(&k, data + i, 4);
-		k *= c1;
-		k = (k << 15) | (k >> 17);
-		k *= c2;
-		h ^= k;
-		h = (h << 13) | (h >> 19);
-		h = h * 5 + 0xe6546b64;
-	}
+	for (int i = 0; i < SLOT_COUNTER_SHARD_COUNT; i++)
+		slot_count += atomic_load(&slab->slot_count_shards[i].delta);
 
-	{
-		uint32_t k = 0;
-		int tail_len = len - i;
+	return slot_count;
+}
 
-		if (tail_len > 0) {
-			memcpy(&k, data + i, tail_len);
-			k *= c1;
-			k = (k << 15) | (k >> 17);
-			k *= c2;
-			h ^= k;
-		}
-	}
+long long get_bmslab_cas_failures(struct bmslab *slab)
+{
+	long long cas_failures = 0;
 
-	h ^= (uint32_t)len;
-	h ^= (h >> 16);
-	h *= 0x85ebca6b;
-	h ^= (h >> 13);
-	h *= 0xc2b2ae35;
-	h ^= (h >> 16);
+	for (int i = 0; i < SLOT_COUNTER_SHARD_COUNT; i++)
+		cas_failures += atomic_load(&slab->slot_count_shards[i].cas_failures);
 
-	return h;
+	return cas_failures;
 }
 
-static inline void *page_start(struct bmslab *slab, int page_idx)
+int get_bmslab_slot_size(struct bmslab *slab)
 {
-	return (void *)((char *)slab->base_addr + (page_idx << PAGE_SHIFT));
+	return slab->slot_size;
 }
 
-static inline uint32_t get_max_slot_count(struct bmslab *slab)
+int get_bmslab_slot_count_per_page(struct bmslab *slab)
 {
-	return atomic_load(&slab->phys_page_count) * slab->slot_count_per_page;
+	return slab->slot_count_per_page;
 }
 
-static inline void lock_page(struct bmslab *slab, int page_idx)
+int get_bmslab_colour_count(struct bmslab *slab)
 {
-	atomic_fetch_or(&slab->page_lock_refs[page_idx], PAGE_LOCK_MASK);
+	return slab->colour_mask + 1;
 }
 
-static inline void unlock_page(struct bmslab *slab, int page_idx)
+int get_bmslab_submap_count(struct bmslab *slab)
+{
+	return slab->submap_count;
+}
+
+int get_bmslab_page_size(struct bmslab *slab)
+{
+	return slab->page_size;
+}
+
+int get_bmslab_dirty_page_count(struct bmslab *slab)
+{
+	return atomic_load(&slab->empty_page_count);
+}
+
+int get_bmslab_purged_page_count(struct bmslab *slab)
 {
-	atomic_fetch_and(&slab->page_lock_refs[page_idx], ~PAGE_LOCK_MASK);
+	return atomic_load(&slab->purged_page_count);
 }
 
-static inline bool is_page_reclaimable(uint64_t page_lock_ref)
+int get_bmslab_huge_page_size(struct bmslab *slab)
 {
-	return (page_lock_ref == PAGE_LOCK_MASK);
+	return slab->huge_page ? HUGE_PAGE_SIZE : 0;
 }
 
 /*
- * adaptive_phys_page_expand - expand physical page count if needed
- * @slab: pointer to bmslab
+ * choose_page_shift - choose the slab page size of the given object size
+ * @obj_size: size of each object
  *
- * Gradually increase the number of physical pages when slot usage exceeds the
- * threshold, but ensure that only one thread performs this operation to prevent
- * exceeding the user-defined memory limit.
+ * Objects up to PAGE_SIZE use a single page. Larger objects use the smallest
+ * power-of-two span that wastes at most 1/8 of its size, or the span with the
+ * least waste if none does. e.g. 6 KiB objects get 32 KiB spans holding five
+ * objects. Keeping spans a power of two lets bmslab_free() find the span with a
+ * shift.
  */
-static void adaptive_phys_page_expand(struct bmslab *slab)
+static uint32_t choose_page_shift(int obj_size)
 {
-	uint32_t slot_count = atomic_load(&slab->allocated_slot_count);
-	uint32_t max_slot_count = get_max_slot_count(slab);
-	uint32_t expected = 0;
-	int new_page_idx;
+	uint32_t shift, best_shift = SPAN_MAX_SHIFT;
+	size_t span, waste, best_waste = SIZE_MAX;
 
-	if (slot_count < PAGE_EXPAND_THRESHOLD(max_slot_count))
-		return;
+	if (obj_size <= PAGE_SIZE)
+		return PAGE_SHIFT;
 
-	if (!atomic_compare_exchange_weak(&slab->phys_page_count_flag,
-			&expected, 1))
-		return;	
+	for (shift = PAGE_SHIFT + 1; shift <= SPAN_MAX_SHIFT; shift++) {
+		span = (size_t)1 << shift;
+		if (span < (size_t)obj_size)
+			continue;
 
-	if (atomic_load(&slab->phys_page_count)
-			< atomic_load(&slab->virt_page_count)) {
-		new_page_idx = atomic_fetch_add(&slab->phys_page_count, 1U);
-		unlock_page(slab, new_page_idx);
+		waste = span % obj_size;
+		if ((waste << 3) <= span)
+			return shift;
+
+		/* Compare waste ratios, waste / span */
+		if (waste * ((size_t)1 << best_shift) < best_waste * span) {
+			best_waste = waste;
+			best_shift = shift;
+		}
 	}
 
-	atomic_store(&slab->phys_page_count_flag, 0);
+	return best_shift;
 }
 
 /*
- * adaptive_phys_page_shrink - shrink physical page count if needed
- * @slab: pointer to bmslab
- *
- * Gradually decrease the number of physical pages when slot usage falls below
- * the threshold.
- *
- * This is performed from the last physical page backward. In this process, the
- * lock bit of page_lock_ref is set first to prevent new allocations. If the
- * reference count also reaches zero, madvise with MADV_FREE is used to release
- * the physical page.
+ * choose_slot_size - distance between two slots
+ * @obj_size: size of each object
+ * @slot_align: alignment boundary that no slot may cross, 0 to pack slots
  *
- * Use slab->phys_page_count_flag to prevent sudden fluctuations in the number
- * of physical pages.
+ * Objects of at least @slot_align bytes are padded to a multiple of it, so
+ * every slot starts on a boundary. Smaller objects are padded to the next power
+ * of two, which divides @slot_align, so a slot never straddles a boundary while
+ * the padding stays below half of the slot.
  */
-static void adaptive_phys_page_shrink(struct bmslab *slab)
+static uint32_t choose_slot_size(int obj_size, int slot_align)
 {
-	uint32_t slot_count = atomic_load(&slab->allocated_slot_count);
-	uint32_t max_slot_count = get_max_slot_count(slab);
-	uint32_t expected = 0;
-	uint64_t page_lock_ref;
-	int last_page_idx;	
-
-	if (slot_count > PAGE_SHRINK_THRESHOLD(max_slot_count))
-		return;
+	uint32_t slot_size = obj_size;
 
-	if (!atomic_compare_exchange_weak(&slab->phys_page_count_flag,
-			&expected, 1))
-		return;	
+	if (slot_align == 0)
+		return slot_size;
 
-	last_page_idx = atomic_load(&slab->phys_page_count) - 1;
-	if (last_page_idx == 0) { /* do not free the first page */
-		atomic_store(&slab->phys_page_count_flag, 0);
-		return;
-	}
+	if (slot_size >= (uint32_t)slot_align)
+		return (slot_size + slot_align - 1) & ~((uint32_t)slot_align - 1);
 
-	lock_page(slab, last_page_idx);
-	atomic_thread_fence(memory_order_seq_cst);
+	while (slot_size & (slot_size - 1))
+		slot_size = (slot_size | (slot_size - 1)) + 1;
 
-	page_lock_ref = atomic_load(&slab->page_lock_refs[last_page_idx]);
-	if (is_page_reclaimable(page_lock_ref)) {
-		/*
-		 * At this point, no new threads can allocate slots on this page, and
-		 * all currently allocated slots have been returned.
-		 *
-		 * Applying the MADV_FREE flag allows the physical memory of this page
-		 * to be freed when memory pressure occurs. Note that if the page is
-		 * accessed before being freed, a write operation will cancle the
-		 * MADV_FREE status.
-		 */
-		madvise(page_start(slab, last_page_idx), PAGE_SIZE, MADV_FREE);
-		atomic_fetch_sub(&slab->phys_page_count, 1U);
-	}
+	return slot_size;
+}
 
-	atomic_store(&slab->phys_page_count_flag, 0);
+/*
+ * map_aligned_region - map an anonymous region aligned to REGION_SIZE
+ * @size: size of the region, a multiple of REGION_SIZE
+ *
+ * One extra region is reserved and the unaligned head and tail are trimmed.
+ */
+static void *map_aligned_region(size_t size)
+{
+	uintptr_t start, aligned;
+	void *addr;
+
+	addr = mmap(NULL, size + REGION_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED)
+		return MAP_FAILED;
+
+	/* Trim the reservation down to the aligned region */
+	start = (uintptr_t)addr;
+	aligned = (start + REGION_SIZE - 1) & ~((uintptr_t)REGION_SIZE - 1);
+	if (aligned > start)
+		munmap(addr, aligned - start);
+	munmap((void *)(aligned + size), start + REGION_SIZE - aligned);
+
+	return (void *)aligned;
 }
 
 /*
- * try_ref_page - try to reference the given page
+ * map_huge_region - map a region backed by 2 MiB pages
  * @slab: pointer to bmslab
- * @page_idx: target page index
+ * @size: size of the region, a multiple of HUGE_PAGE_SIZE
  *
- * Increase the reference counter of the given page
- * (slab->page_lock_refs[page_idx]).
- *
- * If the page was locked, return false. Otherwise return true.
+ * MAP_HUGETLB is tried first. It fails unless enough huge pages are reserved
+ * in the hugetlbfs pool, in which case a 2 MiB-aligned anonymous reservation
+ * is made and marked with MADV_HUGEPAGE so that transparent huge pages can
+ * back it. Hugetlbfs pages do not support MADV_FREE, so they are released
+ * with MADV_DONTNEED.
  */
-static bool try_ref_page(struct bmslab *slab, int page_idx)
+static void *map_huge_region(struct bmslab *slab, size_t size)
 {
-	uint64_t page_lock_ref
-		= atomic_fetch_add(&slab->page_lock_refs[page_idx], 1U);
-
-	if (IS_PAGE_LOCKED(page_lock_ref)) {
-		atomic_fetch_sub(&slab->page_lock_refs[page_idx], 1U);
-		return false;
+	void *addr;
+
+#ifdef MAP_HUGETLB
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (addr != MAP_FAILED) {
+		slab->purge_advice = MADV_DONTNEED;
+		return addr;
 	}
+#endif /* MAP_HUGETLB */
 
-	return true;
+	addr = map_aligned_region(size);
+	if (addr == MAP_FAILED)
+		return MAP_FAILED;
+
+#ifdef MADV_HUGEPAGE
+	madvise(addr, size, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+
+	return addr;
 }
 
 /*
- * bmslab_alloc - allocate one object from bmslab
- * @slab: pointer to bmslab
+ * registry_set - point the registry entries of a slab's regions to @owner
+ * @slab: slab whose mapping is covered
+ * @owner: @slab to register it, NULL to unregister it
  *
- * We use hashing to randomly determine both the page index and submap index to
- * reduce CAS contention.
- *
- * If we find a free bit (0), we set it to 1 with a CAS. On success, compute the
- * slot index => pointer and return.
- *
- * If a slot is allocated, increment the used slot counter. If necessary,
- * increase the number of physical pages. Keeping too few pages may increase the
- * time complexity of allocation.
- *
- * If we exhaust all pages without success, return NULL.
+ * Returns 0 on success, or -1 if a leaf could not be allocated or the mapping
+ * lies outside the addresses the registry covers.
  */
-void *bmslab_alloc(struct bmslab *slab)
+static int registry_set(struct bmslab *slab, struct bmslab *owner)
 {
-	uint32_t page_start_idx, page_idx;
-	uint32_t submap_start_idx, submap_idx, slot_idx;
-	int bit_idx;
-	uint32_t oldv, newv;
-	void *sp;
+	uintptr_t first = (uintptr_t)slab->base_addr >> REGION_SHIFT;
+	uintptr_t last = ((uintptr_t)slab->base_addr + slab->map_size - 1)
+		>> REGION_SHIFT;
+	struct bmslab_registry_leaf *leaf, *expected;
+
+	if (last >> (REGISTRY_ROOT_BITS + REGISTRY_LEAF_BITS))
+		return -1;
+
+	for (uintptr_t region = first; region <= last; region++) {
+		leaf = atomic_load(&registry[region >> REGISTRY_LEAF_BITS]);
+		if (leaf == NULL) {
+			if (owner == NULL)
+				continue;
 
-	if (slab == NULL)
-		return NULL;
+			leaf = calloc(1, sizeof(struct bmslab_registry_leaf));
+			if (leaf == NULL)
+				return -1;
 
-	sp = __builtin_frame_address(0);
+			expected = NULL;
+			if (!atomic_compare_exchange_strong(
+					&registry[region >> REGISTRY_LEAF_BITS], &expected, leaf)) {
+				free(leaf);
+				leaf = expected;
+			}
+		}
+
+		atomic_store(&leaf->slabs[region & ((1 << REGISTRY_LEAF_BITS) - 1)],
+			owner);
+	}
+
+	return 0;
+}
+
+/*
+ * check_config - validate a bmslab_config
+ * @config: configuration given to bmslab_init_ex()
+ *
+ * Returns true if the configuration is usable.
+ */
+static bool check_config(const struct bmslab_config *config)
+{
+	if (config->obj_size < 8 || config->obj_size > MAX_OBJ_SIZE) {
+		fprintf(stderr, "bmslab_init: invalid obj_size\n");
+		return false;
+	}
+
+	if (config->max_page_count <= 0) {
+		fprintf(stderr, "bmslab_init: invalid max_page_count\n");
+		return false;
+	}
+
+	if (config->reserve_page_count < 0) {
+		fprintf(stderr, "bmslab_init: invalid reserve_page_count\n");
+		return false;
+	}
+
+	if (config->expand_threshold < 0 || config->expand_threshold > 100 ||
+			config->shrink_threshold < 0 || config->shrink_threshold > 100) {
+		fprintf(stderr, "bmslab_init: invalid threshold\n");
+		return false;
+	}
+
+	if (config->growth < BMSLAB_GROWTH_FIXED ||
+			config->growth > BMSLAB_GROWTH_EXPONENTIAL ||
+			config->growth_step < 0) {
+		fprintf(stderr, "bmslab_init: invalid growth\n");
+		return false;
+	}
+
+	if (config->min_resident_pages < 0 ||
+			config->min_resident_pages > config->max_page_count ||
+			config->shrink_hysteresis < 0) {
+		fprintf(stderr, "bmslab_init: invalid shrink policy\n");
+		return false;
+	}
+
+	if (config->decay_ms < 0) {
+		fprintf(stderr, "bmslab_init: invalid decay_ms\n");
+		return false;
+	}
+
+	if (config->purge_method != BMSLAB_PURGE_FREE &&
+			config->purge_method != BMSLAB_PURGE_DONTNEED) {
+		fprintf(stderr, "bmslab_init: invalid purge_method\n");
+		return false;
+	}
+
+	if (config->slot_align < 0 || config->slot_align > PAGE_SIZE ||
+			(config->slot_align & (config->slot_align - 1)) != 0 ||
+			(config->slot_align != 0 && config->slot_align < 8)) {
+		fprintf(stderr, "bmslab_init: invalid slot_align\n");
+		return false;
+	}
+
+	if (config->page_size != 0 && (config->page_size < PAGE_SIZE ||
+			config->page_size > (1 << SPAN_MAX_SHIFT) ||
+			(config->page_size & (config->page_size - 1)) != 0)) {
+		fprintf(stderr, "bmslab_init: invalid page_size\n");
+		return false;
+	}
+
+	/* Slots past MAX_SLOT_COUNT could never be tracked, only wasted */
+	if (config->page_size != 0 && (uint32_t)config->page_size /
+			choose_slot_size(config->obj_size, config->slot_align) >
+			MAX_SLOT_COUNT) {
+		fprintf(stderr, "bmslab_init: page_size holds too many slots\n");
+		return false;
+	}
+
+	if (config->colouring < 0) {
+		fprintf(stderr, "bmslab_init: invalid colouring\n");
+		return false;
+	}
+
+	if (config->cacheline_layout < 0) {
+		fprintf(stderr, "bmslab_init: invalid cacheline_layout\n");
+		return false;
+	}
+
+	if (config->placement != BMSLAB_PLACEMENT_HASH &&
+			config->placement != BMSLAB_PLACEMENT_HOME) {
+		fprintf(stderr, "bmslab_init: invalid placement\n");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * map_page_metadata - map the per-page metadata of a slab
+ * @slab: pointer to bmslab, virt_page_count and bitmap_line_count set
+ *
+ * The bitmaps, page locks and nonfull masks share one anonymous mapping, each
+ * array starting on a cache line. Nothing is written here: the kernel hands
+ * out zero pages on first touch, so a large max_page_count only reserves
+ * address space until init_page() reaches the metadata of a page.
+ *
+ * Returns 0 on success, or -1 on failure.
+ */
+static int map_page_metadata(struct bmslab *slab)
+{
+	size_t bitmap_size = sizeof(struct bmslab_bitmap)
+		* slab->bitmap_line_count * slab->virt_page_count;
+	size_t lock_size = sizeof(struct bmslab_page_lock) * slab->virt_page_count;
+	size_t nonfull_size = (sizeof(uint16_t) * slab->virt_page_count + 63)
+		& ~(size_t)63;
+	char *addr;
+
+	slab->meta_size = bitmap_size + lock_size + nonfull_size;
+	addr = mmap(NULL, slab->meta_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED)
+		return -1;
+
+	slab->meta_addr = addr;
+	slab->bitmaps = (struct bmslab_bitmap *)addr;
+	slab->page_locks = (struct bmslab_page_lock *)(addr + bitmap_size);
+	slab->nonfull_submaps = (_Atomic uint16_t *)(addr + bitmap_size + lock_size);
+
+	return 0;
+}
+
+/*
+ * bmslab_init_ex - initializes a bmslab from a configuration
+ * @config: object size, page limit and page policies, zero fields are defaults
+ *
+ * Returns pointer to a bmslab on sucess, or NULL on failure.
+ *
+ * We compute how many slots actually fit (page_size / obj_siz), capped at 1024.
+ * Then we mark only those bits as (0 => free), the rest as (1 => unavailable)
+ * for simple exception handling.
+ *
+ * The first min_resident_pages pages (at least one) are brought online here,
+ * so a slab configured to pre-grow does not expand page by page under load.
+ * The metadata of the other pages is only mapped, and set up by init_page()
+ * when adaptive_phys_page_expand() reaches them, so init time does not grow
+ * with max_page_count.
+ */
+struct bmslab *bmslab_init_ex(const struct bmslab_config *config)
+{
+	uint32_t submap_idx, bit_idx, summary_word_count;
+	struct bmslab *slab;
+
+	if (config == NULL || !check_config(config))
+		return NULL;
+
+	register_fork_handlers();
+	pthread_once(&submap_scan_once, submap_scan_init);
+
+	slab = calloc(1, sizeof(struct bmslab));
+	if (slab == NULL) {
+		fprintf(stderr, "bmslab_init: slab allocation failed\n");
+		return NULL;
+	}
+
+	slab->expand_ratio = DEFAULT_EXPAND_RATIO;
+	if (config->expand_threshold != 0)
+		slab->expand_ratio
+			= (config->expand_threshold << THRESHOLD_SHIFT) / 100;
+
+	slab->shrink_ratio = DEFAULT_SHRINK_RATIO;
+	if (config->shrink_threshold != 0)
+		slab->shrink_ratio
+			= (config->shrink_threshold << THRESHOLD_SHIFT) / 100;
+
+	if (slab->shrink_ratio >= slab->expand_ratio) {
+		fprintf(stderr, "bmslab_init: invalid threshold\n");
+		free(slab);
+		return NULL;
+	}
+
+	slab->growth = config->growth;
+	slab->growth_step = config->growth_step;
+	if (slab->growth_step == 0)
+		slab->growth_step = (slab->growth == BMSLAB_GROWTH_PROPORTIONAL) ? 25 : 1;
+
+	slab->min_resident_pages = config->min_resident_pages;
+	if (slab->min_resident_pages == 0)
+		slab->min_resident_pages = 1;
+	slab->shrink_hysteresis = config->shrink_hysteresis;
+	slab->placement = config->placement;
+
+	slab->decay_ms = config->decay_ms;
+	slab->decay_epoch_ns = ((uint64_t)slab->decay_ms * 1000000ULL)
+		>> DECAY_EPOCH_SHIFT;
+	if (slab->decay_epoch_ns == 0)
+		slab->decay_epoch_ns = 1;
+	atomic_store(&slab->decay_epoch_start, get_time_ns());
+
+	atomic_store(&slab->phys_page_count_flag, 0);
+	slab->virt_page_count = config->max_page_count;
+	if (config->reserve_page_count > config->max_page_count)
+		slab->virt_page_count = config->reserve_page_count;
+	atomic_store(&slab->page_limit, config->max_page_count);
+	atomic_store(&slab->phys_page_count, slab->min_resident_pages);
+	atomic_store(&slab->purged_page_count, 0);
+	atomic_store(&slab->empty_page_count, 0);
+	atomic_store(&slab->allocated_slot_count, 0);
+
+	slab->obj_size = config->obj_size;
+	slab->slot_size = choose_slot_size(config->obj_size, config->slot_align);
+	slab->page_shift = choose_page_shift(slab->slot_size);
+	if (config->page_size != 0)
+		slab->page_shift = __builtin_ctz(config->page_size);
+	slab->page_size = 1U << slab->page_shift;
+	if (slab->slot_size > slab->page_size) {
+		fprintf(stderr, "bmslab_init: page_size smaller than a slot\n");
+		free(slab);
+		return NULL;
+	}
+
+	slab->slot_count_per_page = slab->page_size / slab->slot_size;
+
+	/*
+	 * Submap geometry: as few submaps as keep each at 32 slots or less, so
+	 * pages of large objects are searched in a single word, up to 16. Only
+	 * pages of more than 512 slots fill the 64 bits of a submap.
+	 */
+	slab->submap_shift = 0;
+	while ((1U << slab->submap_shift) < SUBMAP_MAX_COUNT &&
+			(slab->slot_count_per_page >> slab->submap_shift) > 32)
+		slab->submap_shift++;
+	slab->submap_count = 1U << slab->submap_shift;
+	slab->bitmap_line_count = (slab->submap_count + SUBMAP_LINE_COUNT - 1)
+		/ SUBMAP_LINE_COUNT;
+
+	/*
+	 * Colouring: the tail space left after the last slot shifts slot 0 of
+	 * consecutive pages by a cache line each, so that the same slot of
+	 * different pages falls into different cache sets. The number of colours
+	 * is rounded down to a power of two to keep page_colour() a mask and a
+	 * shift. Colours keep the slot alignment.
+	 */
+	slab->colour_shift = CACHELINE_SHIFT;
+	while (config->slot_align > (1 << slab->colour_shift))
+		slab->colour_shift++;
+
+	slab->colour_mask = 0;
+	if (config->colouring) {
+		uint32_t colour_count = ((slab->page_size
+			- slab->slot_count_per_page * slab->slot_size)
+			>> slab->colour_shift) + 1;
+
+		while ((slab->colour_mask + 1) * 2 <= colour_count)
+			slab->colour_mask = slab->colour_mask * 2 + 1;
+	}
+
+	/* Enough consecutive slots per submap to fill a cache line */
+	slab->slot_group_shift = 0;
+	while (config->cacheline_layout && slab->slot_group_shift < 6 &&
+			(slab->slot_size << slab->slot_group_shift) < 64)
+		slab->slot_group_shift++;
+
+	slab->slot_count_shards = aligned_alloc(64,
+		sizeof(struct bmslab_counter_shard) * SLOT_COUNTER_SHARD_COUNT);
+	if (slab->slot_count_shards == NULL) {
+		fprintf(stderr, "bmslab_init: slab->slot_count_shards allocation failed\n");
+		free(slab);
+		return NULL;
+	}
+
+	for (int i = 0; i < SLOT_COUNTER_SHARD_COUNT; i++) {
+		atomic_init(&slab->slot_count_shards[i].delta, 0);
+		atomic_init(&slab->slot_count_shards[i].cas_failures, 0);
+	}
+
+	if (map_page_metadata(slab) != 0) {
+		fprintf(stderr, "bmslab_init: page metadata allocation failed\n");
+		free(slab->slot_count_shards);
+		free(slab);
+		return NULL;
+	}
+
+	summary_word_count = (slab->virt_page_count + 63) >> SUMMARY_SHIFT;
+	slab->page_summary = calloc(summary_word_count, sizeof(uint64_t));
+	slab->page_summary_top = calloc((summary_word_count + 63) >> SUMMARY_SHIFT,
+		sizeof(uint64_t));
+	slab->empty_pages = calloc(summary_word_count, sizeof(uint64_t));
+	slab->purged_pages = calloc(summary_word_count, sizeof(uint64_t));
+	if (slab->page_summary == NULL || slab->page_summary_top == NULL ||
+			slab->empty_pages == NULL || slab->purged_pages == NULL) {
+		fprintf(stderr, "bmslab_init: slab summary allocation failed\n");
+		free(slab->purged_pages);
+		free(slab->empty_pages);
+		free(slab->page_summary_top);
+		free(slab->page_summary);
+		munmap(slab->meta_addr, slab->meta_size);
+		free(slab->slot_count_shards);
+		free(slab);
+		return NULL;
+	}
+
+	/* Whole regions, so that bmslab_owner() can map addresses to slabs */
+	slab->map_size = (size_t)slab->virt_page_count << slab->page_shift;
+	slab->map_size = (slab->map_size + REGION_SIZE - 1)
+		& ~((size_t)REGION_SIZE - 1);
+	slab->huge_page = config->huge_page;
+	slab->purge_advice = (config->purge_method == BMSLAB_PURGE_DONTNEED) ?
+		MADV_DONTNEED : MADV_FREE;
+	if (slab->huge_page)
+		slab->base_addr = map_huge_region(slab, slab->map_size);
+	else
+		slab->base_addr = map_aligned_region(slab->map_size);
+	if (slab->base_addr == MAP_FAILED) {
+		fprintf(stderr, "bmslab_init: slab->base_addr allocation failed\n");
+		free(slab->purged_pages);
+		free(slab->empty_pages);
+		free(slab->page_summary_top);
+		free(slab->page_summary);
+		munmap(slab->meta_addr, slab->meta_size);
+		free(slab->slot_count_shards);
+		free(slab);
+		return NULL;
+	}
+
+	/* All pages share the same layout, distribute slots across the submaps */
+	for (uint32_t i = 0; i < slab->submap_count; i++)
+		slab->empty_submaps[i] = SUBMAP_FULL;
+
+	slab->empty_nonfull = 0;
+	for (uint32_t s = 0; s < slab->slot_count_per_page; s++) {
+		slot_position(slab, s, &submap_idx, &bit_idx);
+
+		slab->empty_submaps[submap_idx] &= ~(1ULL << bit_idx);
+		slab->empty_nonfull |= 1U << submap_idx;
+	}
+
+	/* Pages above phys_page_count are set up when they are brought online */
+	for (uint32_t page_idx = 0; page_idx < slab->min_resident_pages; page_idx++)
+		init_page(slab, page_idx);
+
+	slab->background_reclaim = config->background_reclaim;
+	if (slab->background_reclaim && reclaimer_register(slab) != 0) {
+		fprintf(stderr, "bmslab_init: reclaimer start failed\n");
+		munmap(slab->base_addr, slab->map_size);
+		free(slab->purged_pages);
+		free(slab->empty_pages);
+		free(slab->page_summary_top);
+		free(slab->page_summary);
+		munmap(slab->meta_addr, slab->meta_size);
+		free(slab->slot_count_shards);
+		free(slab);
+		return NULL;
+	}
+
+	if (registry_set(slab, slab) != 0) {
+		fprintf(stderr, "bmslab_init: address registration failed\n");
+		bmslab_destroy(slab);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&slab_list_lock);
+	slab->list_next = slab_list;
+	slab->list_pprev = &slab_list;
+	if (slab_list != NULL)
+		slab_list->list_pprev = &slab->list_next;
+	slab_list = slab;
+	pthread_mutex_unlock(&slab_list_lock);
+
+	return slab;
+}
+
+/*
+ * bmslab_init - initializes a bmslab
+ * @obj_size: size of each object (must be >= 8 and <= MAX_OBJ_SIZE)
+ * @max_page_count: maximum number of slab pages (spans in span mode)
+ */
+struct bmslab *bmslab_init(int obj_size, int max_page_count)
+{
+	struct bmslab_config config = {
+		.obj_size = obj_size,
+		.max_page_count = max_page_count,
+	};
+
+	return bmslab_init_ex(&config);
+}
+
+/*
+ * bmslab_init_hugepage - initializes a bmslab backed by 2 MiB pages
+ * @obj_size: size of each object (must be >= 8 and <= MAX_OBJ_SIZE)
+ * @max_page_count: maximum number of slab pages (spans in span mode)
+ *
+ * Random page selection spreads allocations over the whole online region, so
+ * with 4 KiB pages every slab page costs its own TLB entry. A 2 MiB page covers
+ * 512 of them.
+ */
+struct bmslab *bmslab_init_hugepage(int obj_size, int max_page_count)
+{
+	struct bmslab_config config = {
+		.obj_size = obj_size,
+		.max_page_count = max_page_count,
+		.huge_page = 1,
+	};
+
+	return bmslab_init_ex(&config);
+}
+
+/*
+ * bmslab_destroy - fress the bmslab
+ * @slab: pointer to bmslab
+ *
+ * Magazines of other threads may still reference this slab. They are detached
+ * here and released by their owner threads later. Their cached objects go away
+ * with the mapping.
+ */
+void bmslab_destroy(struct bmslab *slab)
+{
+	struct bmslab_magazine *mag, *next;
+
+	if (slab == NULL)
+		return;
+
+	pthread_mutex_lock(&slab_list_lock);
+	if (slab->list_pprev != NULL) {
+		*slab->list_pprev = slab->list_next;
+		if (slab->list_next != NULL)
+			slab->list_next->list_pprev = slab->list_pprev;
+	}
+	pthread_mutex_unlock(&slab_list_lock);
+
+	registry_set(slab, NULL);
+
+	if (slab->background_reclaim)
+		reclaimer_unregister(slab);
+
+	pthread_mutex_lock(&magazine_lock);
+	for (mag = slab->magazines; mag != NULL; mag = next) {
+		next = mag->slab_next;
+		mag->slab_next = NULL;
+		mag->slab_pprev = NULL;
+		atomic_store(&mag->slab, NULL);
+	}
+	slab->magazines = NULL;
+	pthread_mutex_unlock(&magazine_lock);
+
+	free(slab->purged_pages);
+	free(slab->empty_pages);
+	free(slab->page_summary_top);
+	free(slab->page_summary);
+	munmap(slab->meta_addr, slab->meta_size);
+	free(slab->slot_count_shards);
+	munmap(slab->base_addr, slab->map_size);
+	free(slab);
+}
+
+/*
+ * murmurhash32 - small MurmurHash3 variant for 32-bit output
+ * @key: pointer to data to be hashed
+ * @len: length of the data (in bytes)
+ * @seed: initial seed value
+ */
+static inline uint32_t murmurhash32(const void *key, size_t len, uint32_t seed)
+{
+	const uint8_t *data = (const uint8_t *)key;
+	uint32_t h = seed;
+	const uint32_t c1 = 0xcc9e2d51;
+	const uint32_t c2 = 0x1b873593;
+	size_t i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		uint32_t k;
+		memcpy(&k, data + i, 4);
+		k *= c1;
+		k = (k << 15) | (k >> 17);
+		k *= c2;
+		h ^= k;
+		h = (h << 13) | (h >> 19);
+		h = h * 5 + 0xe6546b64;
+	}
+
+	{
+		uint32_t k = 0;
+		int tail_len = len - i;
+
+		if (tail_len > 0) {
+			memcpy(&k, data + i, tail_len);
+			k *= c1;
+			k = (k << 15) | (k >> 17);
+			k *= c2;
+			h ^= k;
+		}
+	}
+
+	h ^= (uint32_t)len;
+	h ^= (h >> 16);
+	h *= 0x85ebca6b;
+	h ^= (h >> 13);
+	h *= 0xc2b2ae35;
+	h ^= (h >> 16);
+
+	return h;
+}
+
+static inline void *page_start(struct bmslab *slab, int page_idx)
+{
+	return (void *)((char *)slab->base_addr
+		+ ((uintptr_t)page_idx << slab->page_shift));
+}
+
+/* Offset of slot 0 within the page, see bmslab_init_ex() */
+static inline uint32_t page_colour(struct bmslab *slab, uint32_t page_idx)
+{
+	return (page_idx & slab->colour_mask) << slab->colour_shift;
+}
+
+static inline void *slot_start(struct bmslab *slab, uint32_t page_idx,
+	uint32_t slot_idx)
+{
+	return (char *)page_start(slab, page_idx) + page_colour(slab, page_idx)
+		+ slot_idx * slab->slot_size;
+}
+
+/* Online pages that allocators may use, fewer after the limit was lowered */
+static inline uint32_t get_usable_page_count(struct bmslab *slab)
+{
+	uint32_t page_count = atomic_load(&slab->phys_page_count);
+	uint32_t page_limit = atomic_load(&slab->page_limit);
+
+	return page_count < page_limit ? page_count : page_limit;
+}
+
+static inline uint32_t get_max_slot_count(struct bmslab *slab)
+{
+	return (atomic_load(&slab->phys_page_count)
+		- atomic_load(&slab->purged_page_count)) * slab->slot_count_per_page;
+}
+
+static inline void lock_page(struct bmslab *slab, int page_idx)
+{
+	atomic_store(&slab->page_locks[page_idx].locked, 1U);
+}
+
+static inline void unlock_page(struct bmslab *slab, int page_idx)
+{
+	atomic_store(&slab->page_locks[page_idx].locked, 0U);
+}
+
+static inline bool is_page_locked(struct bmslab *slab, int page_idx)
+{
+	return atomic_load(&slab->page_locks[page_idx].locked) != 0;
+}
+
+/* Returns true if no slot of the page is allocated */
+static inline bool is_page_empty(struct bmslab *slab, uint32_t page_idx)
+{
+	_Atomic uint64_t *submaps = page_submaps(slab, page_idx);
+
+	for (uint32_t i = 0; i < slab->submap_count; i++) {
+		if (atomic_load(&submaps[i]) != slab->empty_submaps[i])
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * find_next_bit - find the first set bit in [@from, @limit) of a page bitmap
+ *
+ * Returns @limit if there is none.
+ */
+static uint32_t find_next_bit(_Atomic uint64_t *words, uint32_t from,
+	uint32_t limit)
+{
+	uint32_t word_idx, idx;
+	uint64_t word;
+
+	if (from >= limit)
+		return limit;
+
+	word_idx = from >> SUMMARY_SHIFT;
+	word = atomic_load(&words[word_idx]) & (~0ULL << (from & 63));
+
+	while (word == 0) {
+		if ((++word_idx << SUMMARY_SHIFT) >= limit)
+			return limit;
+		word = atomic_load(&words[word_idx]);
+	}
+
+	idx = (word_idx << SUMMARY_SHIFT) + __builtin_ctzll(word);
+	return idx < limit ? idx : limit;
+}
+
+/* Returns the previous value of the page's bit */
+static inline bool test_and_set_page_bit(_Atomic uint64_t *words,
+	uint32_t page_idx)
+{
+	uint64_t bit = 1ULL << (page_idx & 63);
+
+	return atomic_fetch_or(&words[page_idx >> SUMMARY_SHIFT], bit) & bit;
+}
+
+/* Returns the previous value of the page's bit */
+static inline bool test_and_clear_page_bit(_Atomic uint64_t *words,
+	uint32_t page_idx)
+{
+	uint64_t bit = 1ULL << (page_idx & 63);
+
+	return atomic_fetch_and(&words[page_idx >> SUMMARY_SHIFT], ~bit) & bit;
+}
+
+/*
+ * mark_page_empty - track the page as a purge candidate if it is empty
+ * @slab: pointer to bmslab
+ * @page_idx: target page index
+ *
+ * Called after a free left one of the page's submaps without allocated slots.
+ * The bitmap is one cache line, already hot from the free. Every free does its
+ * check after its own fetch_and, so the last of concurrent frees sees the page
+ * empty. A set bit may go stale when an object is allocated later, which
+ * purge_empty_page() validates anyway.
+ */
+static inline void mark_page_empty(struct bmslab *slab, uint32_t page_idx)
+{
+	if (is_page_empty(slab, page_idx) &&
+			!test_and_set_page_bit(slab->empty_pages, page_idx))
+		atomic_fetch_add(&slab->empty_page_count, 1U);
+}
+
+/*
+ * unmark_page_empty - the page is in use again, drop it from the candidates
+ * @slab: pointer to bmslab
+ * @page_idx: target page index
+ *
+ * This keeps empty_page_count close to the number of really empty pages for
+ * the decay.
+ */
+static inline void unmark_page_empty(struct bmslab *slab, uint32_t page_idx)
+{
+	uint64_t bit = 1ULL << (page_idx & 63);
+
+	if ((atomic_load(&slab->empty_pages[page_idx >> SUMMARY_SHIFT]) & bit) &&
+			test_and_clear_page_bit(slab->empty_pages, page_idx))
+		atomic_fetch_sub(&slab->empty_page_count, 1U);
+}
+
+/*
+ * set_page_summary - mark the page as having non-full submaps
+ * @slab: pointer to bmslab
+ * @page_idx: target page index
+ */
+static void set_page_summary(struct bmslab *slab, uint32_t page_idx)
+{
+	uint32_t word_idx = page_idx >> SUMMARY_SHIFT;
+	uint64_t oldv = atomic_fetch_or(&slab->page_summary[word_idx],
+		1ULL << (page_idx & 63));
+
+	if (oldv == 0) {
+		atomic_fetch_or(&slab->page_summary_top[word_idx >> SUMMARY_SHIFT],
+			1ULL << (word_idx & 63));
+	}
+}
+
+/*
+ * init_page - set up the metadata of a page brought online for the first time
+ * @slab: pointer to bmslab
+ * @page_idx: target page index, not yet visible to allocators
+ *
+ * The metadata mapping is faulted in lazily, so bitmap lines of pages that are
+ * never used cost no memory and no time in bmslab_init_ex(). Padding words
+ * beyond submap_count are kept full, as the vector scans load whole lines.
+ */
+static void init_page(struct bmslab *slab, uint32_t page_idx)
+{
+	_Atomic uint64_t *submaps = page_submaps(slab, page_idx);
+
+	for (uint32_t i = 0; i < slab->bitmap_line_count * SUBMAP_LINE_COUNT; i++) {
+		atomic_store_explicit(&submaps[i], (i < slab->submap_count) ?
+			slab->empty_submaps[i] : SUBMAP_FULL, memory_order_relaxed);
+	}
+
+	atomic_store_explicit(&slab->nonfull_submaps[page_idx],
+		slab->empty_nonfull, memory_order_relaxed);
+	atomic_store_explicit(&slab->page_locks[page_idx].locked, 0U,
+		memory_order_relaxed);
+	set_page_summary(slab, page_idx);
+}
+
+/*
+ * clear_page_summary - mark the page as full
+ * @slab: pointer to bmslab
+ * @page_idx: target page index
+ *
+ * A concurrent set_page_summary() that saw an empty word may run before our
+ * clear of the top-level bit, so the word is checked again after clearing it.
+ */
+static void clear_page_summary(struct bmslab *slab, uint32_t page_idx)
+{
+	uint32_t word_idx = page_idx >> SUMMARY_SHIFT;
+	uint64_t bit = 1ULL << (page_idx & 63), top_bit = 1ULL << (word_idx & 63);
+	_Atomic uint64_t *top = &slab->page_summary_top[word_idx >> SUMMARY_SHIFT];
+
+	if (atomic_fetch_and(&slab->page_summary[word_idx], ~bit) != bit)
+		return;
+
+	atomic_fetch_and(top, ~top_bit);
+	if (atomic_load(&slab->page_summary[word_idx]) != 0)
+		atomic_fetch_or(top, top_bit);
+}
+
+/*
+ * mark_submap_nonfull - called when a submap goes from full to non-full
+ * @slab: pointer to bmslab
+ * @page_idx: target page index
+ * @submap_idx: target submap index
+ */
+static void mark_submap_nonfull(struct bmslab *slab, uint32_t page_idx,
+	uint32_t submap_idx)
+{
+	uint16_t oldv = atomic_fetch_or(&slab->nonfull_submaps[page_idx],
+		(uint16_t)(1U << submap_idx));
+
+	if (oldv == 0)
+		set_page_summary(slab, page_idx);
+}
+
+/*
+ * mark_submap_full - called when a submap goes from non-full to full
+ * @slab: pointer to bmslab
+ * @page_idx: target page index
+ * @submap_idx: target submap index
+ *
+ * A free may hit the submap between the CAS that filled it and the clear of
+ * its nonfull bit here, and that free's mark_submap_nonfull() may already be
+ * done. So the submap is checked again after the clear, and the same is done
+ * for the page summary, so that a free slot never becomes invisible.
+ */
+static void mark_submap_full(struct bmslab *slab, uint32_t page_idx,
+	uint32_t submap_idx)
+{
+	uint16_t bit = 1U << submap_idx, oldv;
+
+	oldv = atomic_fetch_and(&slab->nonfull_submaps[page_idx], (uint16_t)~bit);
+
+	if (atomic_load(&page_submaps(slab, page_idx)[submap_idx]) != SUBMAP_FULL) {
+		mark_submap_nonfull(slab, page_idx, submap_idx);
+		return;
+	}
+
+	if (oldv != bit)
+		return;
+
+	clear_page_summary(slab, page_idx);
+	if (atomic_load(&slab->nonfull_submaps[page_idx]) != 0)
+		set_page_summary(slab, page_idx);
+}
+
+/*
+ * find_nonfull_page - find the next page that may have free slots
+ * @slab: pointer to bmslab
+ * @from: first page index to look at
+ * @limit: page index to stop at
+ *
+ * Words of the page summary that are known to be zero are skipped through the
+ * top-level summary, so the cost does not grow with the number of full pages.
+ * Summary bits are only hints; the caller validates the page.
+ *
+ * Returns the first page index in [@from, @limit) whose summary bit is set, or
+ * @limit if there is none.
+ */
+static uint32_t find_nonfull_page(struct bmslab *slab, uint32_t from,
+	uint32_t limit)
+{
+	uint32_t word_idx, top_idx, page_idx;
+	uint64_t word, top;
+
+	if (from >= limit)
+		return limit;
+
+	word_idx = from >> SUMMARY_SHIFT;
+	word = atomic_load(&slab->page_summary[word_idx]) & (~0ULL << (from & 63));
+
+	while (word == 0) {
+		if ((++word_idx << SUMMARY_SHIFT) >= limit)
+			return limit;
+
+		top_idx = word_idx >> SUMMARY_SHIFT;
+		top = atomic_load(&slab->page_summary_top[top_idx])
+			& (~0ULL << (word_idx & 63));
+
+		while (top == 0) {
+			if ((++top_idx << (2 * SUMMARY_SHIFT)) >= limit)
+				return limit;
+			top = atomic_load(&slab->page_summary_top[top_idx]);
+		}
+
+		word_idx = (top_idx << SUMMARY_SHIFT) + __builtin_ctzll(top);
+		if ((word_idx << SUMMARY_SHIFT) >= limit)
+			return limit;
+
+		word = atomic_load(&slab->page_summary[word_idx]);
+	}
+
+	page_idx = (word_idx << SUMMARY_SHIFT) + __builtin_ctzll(word);
+	return page_idx < limit ? page_idx : limit;
+}
+
+/*
+ * purge_page - release the memory of a purged page
+ * @slab: pointer to bmslab
+ * @page_idx: page index, already marked in slab->purged_pages
+ *
+ * Releasing part of a huge page would split it, so in huge page mode nothing
+ * is released until every slab page inside the huge page has been purged.
+ * Pages that were never brought online hold nothing and count as purged.
+ */
+static void purge_page(struct bmslab *slab, uint32_t page_idx)
+{
+	uint32_t first_page_idx, last_page_idx, page_count;
+
+	if (!slab->huge_page) {
+		madvise(page_start(slab, page_idx), slab->page_size,
+			slab->purge_advice);
+		return;
+	}
+
+	first_page_idx
+		= page_idx & ~((1U << (HUGE_PAGE_SHIFT - slab->page_shift)) - 1);
+	last_page_idx = first_page_idx + (1U << (HUGE_PAGE_SHIFT - slab->page_shift));
+	page_count = atomic_load(&slab->phys_page_count);
+	if (last_page_idx > page_count)
+		last_page_idx = page_count;
+
+	for (uint32_t i = first_page_idx; i < last_page_idx; i++) {
+		if (!(atomic_load(&slab->purged_pages[i >> SUMMARY_SHIFT])
+				& (1ULL << (i & 63))))
+			return;
+	}
+
+	madvise(page_start(slab, first_page_idx), HUGE_PAGE_SIZE,
+		slab->purge_advice);
+}
+
+/*
+ * growth_page_count - number of pages to add in one expansion
+ * @slab: pointer to bmslab
+ * @resident_page_count: pages currently resident
+ */
+static uint32_t growth_page_count(struct bmslab *slab,
+	uint32_t resident_page_count)
+{
+	uint32_t count;
+
+	switch (slab->growth) {
+	case BMSLAB_GROWTH_PROPORTIONAL:
+		count = (uint32_t)(((uint64_t)resident_page_count * slab->growth_step)
+			/ 100);
+		break;
+	case BMSLAB_GROWTH_EXPONENTIAL:
+		count = resident_page_count;
+		break;
+	default:
+		count = slab->growth_step;
+		break;
+	}
+
+	return count > 0 ? count : 1;
+}
+
+/*
+ * adaptive_phys_page_expand - expand physical page count if needed
+ * @slab: pointer to bmslab
+ * @force: expand regardless of the threshold, after an allocation failed
+ *
+ * Gradually increase the number of physical pages when slot usage exceeds the
+ * threshold, but ensure that only one thread performs this operation to prevent
+ * exceeding the user-defined memory limit.
+ *
+ * Purged pages are brought back first, so that the slab stays within the pages
+ * it has already used. Their memory is refaulted on first access. Only if there
+ * are none does the slab grow into new pages. The number of pages added at once
+ * follows slab->growth. Neither goes beyond slab->page_limit.
+ *
+ * The threshold is checked against the approximate slot count, so allocators
+ * that found no free slot pass @force instead of relying on it.
+ *
+ * Returns the number of pages brought online, 0 if none could be or the
+ * threshold was not reached, and -1 if another thread is already expanding.
+ */
+static int adaptive_phys_page_expand(struct bmslab *slab, bool force)
+{
+	uint32_t slot_count = get_approx_slot_count(slab);
+	uint32_t max_slot_count = get_max_slot_count(slab);
+	uint32_t expected = 0, page_count, page_limit, count, added = 0;
+	int new_page_idx;
+
+	if (!force && slot_count < PAGE_EXPAND_THRESHOLD(slab, max_slot_count))
+		return 0;
+
+	if (!atomic_compare_exchange_weak(&slab->phys_page_count_flag,
+			&expected, 1))
+		return -1;
+
+	page_count = atomic_load(&slab->phys_page_count);
+	page_limit = atomic_load(&slab->page_limit);
+	count = growth_page_count(slab,
+		page_count - atomic_load(&slab->purged_page_count));
+
+	while (count > 0 && atomic_load(&slab->purged_page_count) > 0) {
+		new_page_idx = find_next_bit(slab->purged_pages, 0,
+			page_count < page_limit ? page_count : page_limit);
+		if (new_page_idx >= (int)page_count || new_page_idx >= (int)page_limit)
+			break;
+
+		test_and_clear_page_bit(slab->purged_pages, new_page_idx);
+		atomic_fetch_sub(&slab->purged_page_count, 1U);
+
+		if (atomic_load(&slab->nonfull_submaps[new_page_idx]) != 0)
+			set_page_summary(slab, new_page_idx);
+		unlock_page(slab, new_page_idx);
+		added++;
+		count--;
+	}
+
+	while (count > 0 && page_count < page_limit) {
+		/* Publish the page only after its bitmap is set up */
+		init_page(slab, page_count);
+		atomic_fetch_add(&slab->phys_page_count, 1U);
+		page_count++;
+		added++;
+		count--;
+	}
+
+	if (added > 0)
+		atomic_fetch_add(&slab->online_gen, 1U);
+
+	atomic_store(&slab->phys_page_count_flag, 0);
+	return (int)added;
+}
+
+/*
+ * try_purge_page - purge a page if its bitmap is empty
+ * @slab: pointer to bmslab, slab->phys_page_count_flag held by the caller
+ * @page_idx: online page that is not locked
+ *
+ * The page is locked first, and then its bitmap is checked. An allocator
+ * claims its slot first and checks the lock afterwards, giving the slot back if
+ * the page is locked. Since both sides write, then read the other's location
+ * with sequentially consistent operations, at least one of them sees the other:
+ * either the shrinker sees the claimed slot, or the allocator sees the lock.
+ *
+ * If the bitmap is still empty, madvise with slab->purge_advice (MADV_FREE
+ * unless configured otherwise) is used to release the physical page, and the
+ * page stays locked and marked in slab->purged_pages until it is reused.
+ *
+ * Returns true if the page was purged.
+ */
+static bool try_purge_page(struct bmslab *slab, uint32_t page_idx)
+{
+	lock_page(slab, page_idx);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!is_page_empty(slab, page_idx)) {
+		/*
+		 * An object was allocated after the page became empty. Leaving the
+		 * page locked would hide its free slots, and it will be tracked again
+		 * once it becomes empty.
+		 */
+		unlock_page(slab, page_idx);
+		return false;
+	}
+
+	/*
+	 * At this point, no new threads can allocate slots on this page, and
+	 * all currently allocated slots have been returned.
+	 *
+	 * Applying the MADV_FREE flag allows the physical memory of this page
+	 * to be freed when memory pressure occurs. Note that if the page is
+	 * accessed before being freed, a write operation will cancle the
+	 * MADV_FREE status. In huge page mode the release is deferred by
+	 * purge_page() until the whole huge page is purged.
+	 */
+	test_and_set_page_bit(slab->purged_pages, page_idx);
+	atomic_fetch_add(&slab->purged_page_count, 1U);
+	clear_page_summary(slab, page_idx);
+	purge_page(slab, page_idx);
+	return true;
+}
+
+/*
+ * purge_empty_page - purge one empty page
+ * @slab: pointer to bmslab, slab->phys_page_count_flag held by the caller
+ *
+ * One page that a free left empty is picked from slab->empty_pages, starting
+ * where the previous search stopped, so a single long-lived object cannot pin
+ * the other pages, and handed to try_purge_page(). At least
+ * slab->min_resident_pages pages are kept resident.
+ *
+ * Returns true if an empty page was examined.
+ */
+static bool purge_empty_page(struct bmslab *slab)
+{
+	uint32_t page_count = atomic_load(&slab->phys_page_count);
+	uint32_t page_idx;
+
+	if (page_count - atomic_load(&slab->purged_page_count)
+			<= slab->min_resident_pages)
+		return false;
+
+	page_idx = find_next_bit(slab->empty_pages, slab->reclaim_cursor,
+		page_count);
+	if (page_idx == page_count)
+		page_idx = find_next_bit(slab->empty_pages, 0, page_count);
+
+	if (page_idx == page_count ||
+			!test_and_clear_page_bit(slab->empty_pages, page_idx))
+		return false;
+
+	atomic_fetch_sub(&slab->empty_page_count, 1U);
+	slab->reclaim_cursor = page_idx + 1;
+
+	/* An allocator that was refused by the lock may have left a stale bit */
+	if (!is_page_locked(slab, page_idx))
+		try_purge_page(slab, page_idx);
+
+	return true;
+}
+
+/*
+ * purge_pages_above_limit - purge the empty pages a lowered limit cut off
+ * @slab: pointer to bmslab, slab->phys_page_count_flag held by the caller
+ * @page_limit: new page limit
+ *
+ * Pages at or above @page_limit are no longer searched, so nothing would be
+ * allocated on them again. The empty ones are purged right away instead of
+ * waiting for the usage threshold. Pages still holding objects are purged by
+ * the shrinker once their last object is freed. At least
+ * slab->min_resident_pages pages are kept resident.
+ */
+static void purge_pages_above_limit(struct bmslab *slab, uint32_t page_limit)
+{
+	uint32_t page_count = atomic_load(&slab->phys_page_count);
+
+	for (uint32_t i = page_limit; i < page_count; i++) {
+		if (page_count - atomic_load(&slab->purged_page_count)
+				<= slab->min_resident_pages)
+			break;
+
+		/* Only the flag holder locks pages, so this one is purged already */
+		if (is_page_locked(slab, i))
+			continue;
+
+		if (try_purge_page(slab, i) &&
+				test_and_clear_page_bit(slab->empty_pages, i))
+			atomic_fetch_sub(&slab->empty_page_count, 1U);
+	}
+}
+
+/*
+ * decay_dirty_limit - advance the decay epochs and compute the dirty limit
+ * @slab: pointer to bmslab, slab->phys_page_count_flag held by the caller
+ * @now: current time in nanoseconds
+ *
+ * Like jemalloc's decay, pages that became empty during an epoch are recorded
+ * in slab->decay_backlog, and each entry is allowed to stay dirty with a weight
+ * that follows a smoothstep curve from 1 (this epoch) down to 0 (decay_ms ago).
+ * With DECAY_EPOCH_COUNT being a power of two, the curve needs no division:
+ * for k = 1..N, weight(k) / N^3 = k^2 (3N - 2k) / N^3.
+ *
+ * Returns the number of empty pages that may stay dirty.
+ */
+static uint32_t decay_dirty_limit(struct bmslab *slab, uint64_t now)
+{
+	uint64_t start = atomic_load(&slab->decay_epoch_start);
+	uint64_t advance = (now - start) / slab->decay_epoch_ns;
+	uint32_t empty_count = atomic_load(&slab->empty_page_count);
+	uint64_t limit = 0, k;
+	uint32_t i;
+
+	atomic_store(&slab->decay_epoch_start,
+		start + advance * slab->decay_epoch_ns);
+
+	if (advance >= DECAY_EPOCH_COUNT) {
+		memset(slab->decay_backlog, 0, sizeof(slab->decay_backlog));
+	} else {
+		memmove(slab->decay_backlog, slab->decay_backlog + advance,
+			(DECAY_EPOCH_COUNT - advance) * sizeof(uint32_t));
+		memset(slab->decay_backlog + DECAY_EPOCH_COUNT - advance, 0,
+			advance * sizeof(uint32_t));
+	}
+
+	slab->decay_backlog[DECAY_EPOCH_COUNT - 1]
+		= empty_count > slab->decay_dirty_count ?
+			empty_count - slab->decay_dirty_count : 0;
+
+	for (i = 0; i < DECAY_EPOCH_COUNT; i++) {
+		k = i + 1;
+		limit += slab->decay_backlog[i]
+			* (k * k * (3 * DECAY_EPOCH_COUNT - 2 * k));
+	}
+
+	return (uint32_t)(limit >> (3 * DECAY_EPOCH_SHIFT));
+}
+
+/*
+ * adaptive_phys_page_shrink - shrink physical page count if needed
+ * @slab: pointer to bmslab
+ *
+ * Gradually decrease the number of physical pages when slot usage falls below
+ * the threshold, one page per call (see purge_empty_page()). Nothing is purged
+ * while no more than slab->shrink_hysteresis pages are empty.
+ *
+ * With slab->decay_ms set, usage is not looked at. Once per decay epoch, empty
+ * pages are purged down to the limit of decay_dirty_limit(), so pages that
+ * became empty recently stay warm and are purged gradually as they age.
+ *
+ * Use slab->phys_page_count_flag to prevent sudden fluctuations in the number
+ * of physical pages.
+ *
+ * Returns true if it is worth calling again, so the reclaimer can repeat it
+ * until there is nothing left to do.
+ */
+static bool adaptive_phys_page_shrink(struct bmslab *slab)
+{
+	uint32_t slot_count = get_approx_slot_count(slab);
+	uint32_t max_slot_count = get_max_slot_count(slab);
+	uint32_t expected = 0, limit;
+	uint64_t now = 0;
+	bool progress;
+
+	if (atomic_load(&slab->empty_page_count) <= slab->shrink_hysteresis)
+		return false;
+
+	if (slab->decay_ms != 0) {
+		now = get_time_ns();
+		if (now - atomic_load(&slab->decay_epoch_start) < slab->decay_epoch_ns)
+			return false;
+	} else if (slot_count > PAGE_SHRINK_THRESHOLD(slab, max_slot_count)) {
+		/*
+		 * The folded count may be ahead by the shard deltas. Within that
+		 * error, sum the shards, or a slab of large objects would keep up to
+		 * that many slots worth of empty pages resident forever.
+		 */
+		if (slot_count > PAGE_SHRINK_THRESHOLD(slab, max_slot_count)
+				+ SLOT_COUNTER_SHARD_COUNT * SLOT_COUNTER_BATCH ||
+				get_bmslab_allocated_slots(slab)
+					> (int64_t)PAGE_SHRINK_THRESHOLD(slab, max_slot_count))
+			return false;
+	}
+
+	if (!atomic_compare_exchange_weak(&slab->phys_page_count_flag,
+			&expected, 1))
+		return false;
+
+	if (slab->decay_ms == 0) {
+		progress = purge_empty_page(slab);
+		atomic_store(&slab->phys_page_count_flag, 0);
+		return progress;
+	}
+
+	/* Recheck, another thread may have advanced the epoch */
+	if (now - atomic_load(&slab->decay_epoch_start) >= slab->decay_epoch_ns) {
+		limit = decay_dirty_limit(slab, now);
+		if (limit < slab->shrink_hysteresis)
+			limit = slab->shrink_hysteresis;
+
+		while (atomic_load(&slab->empty_page_count) > limit &&
+				purge_empty_page(slab))
+			;
+
+		slab->decay_dirty_count = atomic_load(&slab->empty_page_count);
+	}
+
+	atomic_store(&slab->phys_page_count_flag, 0);
+	return false;
+}
+
+/*
+ * reclaimer_func - body of the background reclaimer thread
+ * @arg: unused
+ *
+ * Every reclaimer_interval_ms, each registered slab is shrunk until
+ * adaptive_phys_page_shrink() finds nothing more to purge.
+ */
+static void *reclaimer_func(void *arg)
+{
+	struct bmslab *slab;
+	struct timespec deadline;
+
+	(void)arg;
+
+	pthread_mutex_lock(&reclaimer_lock);
+	for (;;) {
+		while (reclaimer_slabs == NULL)
+			pthread_cond_wait(&reclaimer_cond, &reclaimer_lock);
+
+		for (slab = reclaimer_slabs; slab != NULL; slab = slab->reclaim_next) {
+			while (adaptive_phys_page_shrink(slab))
+				;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += reclaimer_interval_ms / 1000;
+		deadline.tv_nsec += (long)(reclaimer_interval_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&reclaimer_cond, &reclaimer_lock, &deadline);
+	}
+
+	return NULL;
+}
+
+/*
+ * reclaimer_register - add a slab to the background reclaimer
+ * @slab: pointer to bmslab
+ *
+ * Starts the reclaimer thread if it is not running yet.
+ * Returns 0 on success, or -1 if the thread could not be created.
+ */
+static int reclaimer_register(struct bmslab *slab)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret = 0;
+
+	pthread_mutex_lock(&reclaimer_lock);
+
+	if (!reclaimer_started) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		ret = pthread_create(&thread, &attr, reclaimer_func, NULL);
+		pthread_attr_destroy(&attr);
+		if (ret != 0) {
+			pthread_mutex_unlock(&reclaimer_lock);
+			return -1;
+		}
+		reclaimer_started = true;
+	}
+
+	slab->reclaim_next = reclaimer_slabs;
+	reclaimer_slabs = slab;
+	pthread_cond_signal(&reclaimer_cond);
+
+	pthread_mutex_unlock(&reclaimer_lock);
+	return 0;
+}
+
+/*
+ * reclaimer_unregister - remove a slab from the background reclaimer
+ * @slab: pointer to bmslab
+ *
+ * Once this returns, the reclaimer no longer touches the slab.
+ */
+static void reclaimer_unregister(struct bmslab *slab)
+{
+	struct bmslab **pp;
+
+	pthread_mutex_lock(&reclaimer_lock);
+	for (pp = &reclaimer_slabs; *pp != NULL; pp = &(*pp)->reclaim_next) {
+		if (*pp == slab) {
+			*pp = slab->reclaim_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&reclaimer_lock);
+}
+
+/*
+ * fork_prepare - quiesce bmslab before fork()
+ *
+ * A lock held by another thread at fork() stays held forever in the child.
+ * Wait for the pending once initializers, then take the global locks and the
+ * phys_page_count_flag of every slab, so that no expand or shrink is half done
+ * when the address space is copied. No other path takes these locks in the
+ * reverse order, and a flag holder never waits for any of them.
+ */
+static void fork_prepare(void)
+{
+	uint32_t expected;
+
+	pthread_once(&submap_scan_once, submap_scan_init);
+	pthread_once(&magazine_key_once, magazine_key_init);
+
+	pthread_mutex_lock(&slab_list_lock);
+	pthread_mutex_lock(&reclaimer_lock);
+	pthread_mutex_lock(&magazine_lock);
+
+	for (struct bmslab *slab = slab_list; slab != NULL; slab = slab->list_next) {
+		expected = 0;
+		while (!atomic_compare_exchange_weak(&slab->phys_page_count_flag,
+				&expected, 1)) {
+			expected = 0;
+			sched_yield();
+		}
+	}
+}
+
+static void fork_release_flags(void)
+{
+	for (struct bmslab *slab = slab_list; slab != NULL; slab = slab->list_next)
+		atomic_store(&slab->phys_page_count_flag, 0);
+}
+
+static void fork_parent(void)
+{
+	fork_release_flags();
+
+	pthread_mutex_unlock(&magazine_lock);
+	pthread_mutex_unlock(&reclaimer_lock);
+	pthread_mutex_unlock(&slab_list_lock);
+}
+
+/*
+ * fork_child - reset bmslab in the child of fork()
+ *
+ * Only the forking thread exists in the child. The locks are reinitialized,
+ * and so is the reclaimer's condition variable, as the reclaimer thread is
+ * gone. It is started again with the next slab that uses it. Objects cached in
+ * the magazines of the other threads stay allocated in the child.
+ */
+static void fork_child(void)
+{
+	fork_release_flags();
+
+	pthread_mutex_init(&magazine_lock, NULL);
+	pthread_cond_init(&reclaimer_cond, NULL);
+	reclaimer_started = false;
+	pthread_mutex_init(&reclaimer_lock, NULL);
+	pthread_mutex_init(&slab_list_lock, NULL);
+}
+
+/*
+ * register_fork_handlers - install the fork handlers once per process
+ *
+ * Not a pthread_once, which would itself stay pending in the child if another
+ * thread forked while it ran.
+ */
+static void register_fork_handlers(void)
+{
+	if (atomic_load(&fork_handlers_registered) ||
+			atomic_exchange(&fork_handlers_registered, true))
+		return;
+
+	if (pthread_atfork(fork_prepare, fork_parent, fork_child) != 0)
+		fprintf(stderr, "bmslab_init: fork handler registration failed\n");
+}
+
+/*
+ * bmslab_set_reclaim_interval - set the wakeup interval of the reclaimer
+ * @interval_ms: interval in milliseconds (> 0)
+ *
+ * Applies to all slabs created with background_reclaim, starting from the
+ * next wakeup. Returns 0 on success, or -1 if the interval is invalid.
+ */
+int bmslab_set_reclaim_interval(int interval_ms)
+{
+	if (interval_ms <= 0) {
+		fprintf(stderr, "bmslab_set_reclaim_interval: invalid interval\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&reclaimer_lock);
+	reclaimer_interval_ms = interval_ms;
+	pthread_cond_signal(&reclaimer_cond);
+	pthread_mutex_unlock(&reclaimer_lock);
+	return 0;
+}
+
+/*
+ * bmslab_set_limit - change the number of pages a slab may use
+ * @slab: pointer to bmslab
+ * @max_page_count: new limit, from min_resident_pages to the pages reserved at
+ * init (reserve_page_count, or max_page_count if it was not set)
+ *
+ * Can be called while other threads allocate and free. Raising the limit lets
+ * the slab grow into the reserved address space, whose metadata is set up
+ * page by page as it is reached. After lowering it, pages above the limit are
+ * no longer handed out, and those that are empty are purged before returning.
+ * Objects left on the others can still be freed, and the shrinker purges those
+ * pages once they are empty. Objects keep their address either way, so
+ * bmslab_free() still finds the page with one shift.
+ *
+ * Returns 0 on success, or -1 if the limit is out of range.
+ */
+int bmslab_set_limit(struct bmslab *slab, int max_page_count)
+{
+	uint32_t expected = 0, old_limit;
+
+	if (slab == NULL || max_page_count < (int)slab->min_resident_pages ||
+			max_page_count > (int)slab->virt_page_count) {
+		fprintf(stderr, "bmslab_set_limit: invalid max_page_count\n");
+		return -1;
+	}
+
+	/* Wait for expand and shrink, which read the limit under the flag */
+	while (!atomic_compare_exchange_weak(&slab->phys_page_count_flag,
+			&expected, 1)) {
+		expected = 0;
+		sched_yield();
+	}
+
+	old_limit = atomic_exchange(&slab->page_limit, (uint32_t)max_page_count);
+	if ((uint32_t)max_page_count < old_limit)
+		purge_pages_above_limit(slab, (uint32_t)max_page_count);
+
+	atomic_store(&slab->phys_page_count_flag, 0);
+
+	/* Online pages above the old limit have become usable */
+	atomic_fetch_add(&slab->online_gen, 1U);
+	return 0;
+}
+
+/*
+ * release_claim - give back slots claimed on a page that turned out locked
+ * @slab: pointer to bmslab
+ * @page_idx: target page index
+ * @submap_idx: submap of the slots
+ * @mask: claimed bits
+ */
+static void release_claim(struct bmslab *slab, uint32_t page_idx,
+	uint32_t submap_idx, uint64_t mask)
+{
+	uint64_t oldv
+		= atomic_fetch_and(&page_submaps(slab, page_idx)[submap_idx], ~mask);
+
+	if (oldv == SUBMAP_FULL)
+		mark_submap_nonfull(slab, page_idx, submap_idx);
+
+	if ((oldv & ~mask) == slab->empty_submaps[submap_idx])
+		mark_page_empty(slab, page_idx);
+}
+
+/*
+ * scan_submaps_scalar - non-full submaps from the page's non-full mask
+ */
+static uint32_t scan_submaps_scalar(struct bmslab *slab, uint32_t page_idx)
+{
+	return atomic_load(&slab->nonfull_submaps[page_idx]);
+}
+
+#ifdef BMSLAB_X86
+/*
+ * snapshot_submaps - copy the bitmap lines of a page for the vector scans
+ * @slab: pointer to bmslab
+ * @page_idx: target page index
+ * @lines: destination, bitmap_line_count lines
+ *
+ * Vector loads are not atomic accesses, so the submaps, which other threads
+ * CAS and fetch_and, are read with relaxed atomic loads first. A stale submap
+ * only costs a failed CAS, as with the scalar search. Padding submaps of a
+ * line are full, so they never show up in the result.
+ */
+static inline void snapshot_submaps(struct bmslab *slab, uint32_t page_idx,
+	uint64_t *lines)
+{
+	_Atomic uint64_t *submaps = page_submaps(slab, page_idx);
+
+	for (uint32_t i = 0; i < slab->bitmap_line_count * SUBMAP_LINE_COUNT; i++)
+		lines[i] = atomic_load_explicit(&submaps[i], memory_order_relaxed);
+}
+
+__attribute__((target("sse2")))
+static uint32_t scan_submaps_sse2(struct bmslab *slab, uint32_t page_idx)
+{
+	_Alignas(64) uint64_t lines[SUBMAP_MAX_COUNT];
+	const __m128i *line = (const __m128i *)(void *)lines;
+	__m128i full = _mm_set1_epi32(-1);
+	uint32_t mask = 0, halves;
+
+	snapshot_submaps(slab, page_idx, lines);
+
+	/* No 64-bit compare in SSE2, a submap is full if both halves are */
+	for (uint32_t i = 0; i < slab->bitmap_line_count * 4; i++) {
+		halves = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(
+			_mm_cmpeq_epi32(_mm_load_si128(line + i), full)));
+		halves &= halves >> 1;
+		mask |= ((halves & 1) | ((halves >> 1) & 2)) << (i * 2);
+	}
+
+	return ~mask & ((1U << slab->submap_count) - 1);
+}
+
+__attribute__((target("avx2")))
+static uint32_t scan_submaps_avx2(struct bmslab *slab, uint32_t page_idx)
+{
+	_Alignas(64) uint64_t lines[SUBMAP_MAX_COUNT];
+	const __m256i *line = (const __m256i *)(void *)lines;
+	__m256i full = _mm256_set1_epi64x(-1);
+	uint32_t mask = 0;
+
+	snapshot_submaps(slab, page_idx, lines);
+
+	for (uint32_t i = 0; i < slab->bitmap_line_count * 2; i++) {
+		mask |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(
+			_mm256_cmpeq_epi64(_mm256_load_si256(line + i), full))) << (i * 4);
+	}
+
+	return ~mask & ((1U << slab->submap_count) - 1);
+}
+
+__attribute__((target("avx512f")))
+static uint32_t scan_submaps_avx512(struct bmslab *slab, uint32_t page_idx)
+{
+	_Alignas(64) uint64_t lines[SUBMAP_MAX_COUNT];
+	const __m512i *line = (const __m512i *)(void *)lines;
+	__m512i full = _mm512_set1_epi64(-1);
+	uint32_t mask = 0;
+
+	snapshot_submaps(slab, page_idx, lines);
+
+	for (uint32_t i = 0; i < slab->bitmap_line_count; i++) {
+		mask |= (uint32_t)_mm512_cmpneq_epi64_mask(
+			_mm512_load_si512(line + i), full) << (i * 8);
+	}
+
+	return mask & ((1U << slab->submap_count) - 1);
+}
+#endif /* BMSLAB_X86 */
+
+/*
+ * bmslab_set_simd - select the non-full submap search
+ * @level: one of enum bmslab_simd
+ *
+ * BMSLAB_SIMD_AUTO, which the first bmslab_init_ex() uses, picks the scalar
+ * search. It reads one 16-bit mask per page that allocation and free maintain
+ * anyway, while a vector scan first has to copy 8 or 16 submaps with atomic
+ * loads; in the benchmark no vector level beat it. The vector levels stay
+ * available for comparison. Call it before the slabs are shared with other
+ * threads.
+ *
+ * Returns 0 on success, or -1 if the level is unknown or not supported.
+ */
+int bmslab_set_simd(int level)
+{
+	submap_scan_fn fn = scan_submaps_scalar;
+
+#ifdef BMSLAB_X86
+	__builtin_cpu_init();
+
+	if (level == BMSLAB_SIMD_AUTO)
+		level = BMSLAB_SIMD_SCALAR;
+
+	if ((level == BMSLAB_SIMD_SSE2 && !__builtin_cpu_supports("sse2")) ||
+			(level == BMSLAB_SIMD_AVX2 && !__builtin_cpu_supports("avx2")) ||
+			(level == BMSLAB_SIMD_AVX512 &&
+				!__builtin_cpu_supports("avx512f"))) {
+		fprintf(stderr, "bmslab_set_simd: level not supported\n");
+		return -1;
+	}
+
+	if (level == BMSLAB_SIMD_SSE2)
+		fn = scan_submaps_sse2;
+	else if (level == BMSLAB_SIMD_AVX2)
+		fn = scan_submaps_avx2;
+	else if (level == BMSLAB_SIMD_AVX512)
+		fn = scan_submaps_avx512;
+#else
+	if (level == BMSLAB_SIMD_AUTO)
+		level = BMSLAB_SIMD_SCALAR;
+#endif /* BMSLAB_X86 */
+
+	if (level != BMSLAB_SIMD_SCALAR && fn == scan_submaps_scalar) {
+		fprintf(stderr, "bmslab_set_simd: invalid level\n");
+		return -1;
+	}
+
+	atomic_store(&submap_scan_level, level);
+	atomic_store(&submap_scan, fn);
+	return 0;
+}
+
+static void submap_scan_init(void)
+{
+	if (atomic_load(&submap_scan) == NULL)
+		bmslab_set_simd(BMSLAB_SIMD_AUTO);
+}
+
+int get_bmslab_simd(void)
+{
+	pthread_once(&submap_scan_once, submap_scan_init);
+	return atomic_load(&submap_scan_level);
+}
+
+/*
+ * page_cursor - wrap-around walk over the non-full pages
+ * @start_idx: page index the walk started from
+ * @next_idx: next page index to look at
+ * @limit: end of the current range
+ * @wrapped: true once the walk has wrapped to page 0
+ */
+struct page_cursor {
+	uint32_t start_idx;
+	uint32_t next_idx;
+	uint32_t limit;
+	bool wrapped;
+};
+
+static inline void init_page_cursor(struct page_cursor *cursor,
+	uint32_t start_idx, uint32_t page_count)
+{
+	cursor->start_idx = start_idx;
+	cursor->next_idx = start_idx;
+	cursor->limit = page_count;
+	cursor->wrapped = false;
+}
+
+/*
+ * next_nonfull_page - move the cursor to the next page that may have free slots
+ * @slab: pointer to bmslab
+ * @cursor: walk state
+ * @page_idx: found page index
+ *
+ * Returns false once every page has been visited.
+ */
+static inline bool next_nonfull_page(struct bmslab *slab,
+	struct page_cursor *cursor, uint32_t *page_idx)
+{
+	uint32_t idx;
+
+	for (;;) {
+		idx = find_nonfull_page(slab, cursor->next_idx, cursor->limit);
+		if (idx < cursor->limit) {
+			cursor->next_idx = idx + 1;
+			*page_idx = idx;
+			return true;
+		}
+
+		if (cursor->wrapped)
+			return false;
+
+		cursor->wrapped = true;
+		cursor->next_idx = 0;
+		cursor->limit = cursor->start_idx;
+	}
+}
+
+/*
+ * Non-full submaps of the page, rotated so that bit 0 stands for @start_idx.
+ */
+static inline uint32_t rotated_nonfull_submaps(struct bmslab *slab,
+	uint32_t page_idx, uint32_t start_idx)
+{
+	uint32_t mask = atomic_load_explicit(&submap_scan,
+		memory_order_relaxed)(slab, page_idx);
+
+	return ((mask >> start_idx) | (mask << (slab->submap_count - start_idx)))
+		& ((1U << slab->submap_count) - 1);
+}
+
+/*
+ * get_home - home position of the calling thread
+ * @slab: pointer to bmslab
+ * @page_count: number of usable pages
+ *
+ * A thread's home page is picked from the hash of its sequence number, so
+ * threads start on different pages. A slab usually has a single page when a
+ * thread first allocates, so the homes are spread again over the current page
+ * count whenever it has changed. In between, the home follows the page of the
+ * last successful allocation, which makes a thread that had to steal from
+ * another page stay there until that page fills up as well.
+ */
+static inline struct bmslab_home *get_home(struct bmslab *slab,
+	uint32_t page_count)
+{
+	struct bmslab_home *home
+		= &tls_homes[((uintptr_t)slab >> 6) % HOME_CACHE_SIZE];
+	uint32_t seq;
+
+	if (home->slab != slab) {
+		seq = get_thread_seq();
+		home->slab = slab;
+		home->hash = murmurhash32(&seq, sizeof(seq), 0);
+		home->page_count = 0;
+	}
+
+	if (home->page_count != page_count) {
+		home->page_count = page_count;
+		home->page_idx = home->hash % page_count;
+		home->submap_idx = 0;
+	}
+
+	return home;
+}
+
+/*
+ * home_start_page - page where the walk of a home placed thread starts
+ * @slab: pointer to bmslab
+ * @home: home position of the thread
+ * @page_count: number of usable pages
+ *
+ * The home page while it has free slots. Once it is full, threads that share
+ * it would all steal the next non-full page after it, so the walk starts at an
+ * offset of the thread's own instead.
+ */
+static inline uint32_t home_start_page(struct bmslab *slab,
+	struct bmslab_home *home, uint32_t page_count)
+{
+	if (atomic_load_explicit(&slab->nonfull_submaps[home->page_idx],
+			memory_order_relaxed) != 0 &&
+			!is_page_locked(slab, home->page_idx))
+		return home->page_idx;
+
+	return (home->page_idx + (home->hash >> 16) % page_count) % page_count;
+}
+
+/*
+ * choose_submap_start - submap where the search within a page starts
+ * @slab: pointer to bmslab
+ * @home: home position of the thread, NULL unless BMSLAB_PLACEMENT_HOME
+ * @page_idx: page to search
+ * @sp: hash key of the hashed placement
+ *
+ * With the cache-line layout, threads of hashed placement start from a submap
+ * of their own instead of a random one, so that the slots of a cache line tend
+ * to be handed to a single thread.
+ */
+static inline uint32_t choose_submap_start(struct bmslab *slab,
+	struct bmslab_home *home, uint32_t page_idx, void *sp)
+{
+	if (home != NULL)
+		return page_idx == home->page_idx ? home->submap_idx : 0;
+
+	if (slab->slot_group_shift != 0)
+		return get_thread_seq() & (slab->submap_count - 1);
+
+	return murmurhash32(&sp, sizeof(sp), tls_murmur_seed++)
+		& (slab->submap_count - 1);
+}
+
+/*
+ * advance_home - move the home position past an allocated slot
+ * @slab: pointer to bmslab
+ * @home: home position of the thread
+ * @page_idx: page of the slot
+ * @submap_idx: submap of the slot
+ * @bit_idx: bit of the slot
+ *
+ * The next slot in address order is in the same submap until the end of the
+ * slot group, then in the next submap.
+ */
+static inline void advance_home(struct bmslab *slab, struct bmslab_home *home,
+	uint32_t page_idx, uint32_t submap_idx, uint32_t bit_idx)
+{
+	uint32_t group_mask = (1U << slab->slot_group_shift) - 1;
+
+	home->page_idx = page_idx;
+	home->submap_idx = submap_idx;
+	if ((bit_idx & group_mask) == group_mask)
+		home->submap_idx = (submap_idx + 1) & (slab->submap_count - 1);
+}
+
+/*
+ * __bmslab_alloc - allocate one object from the shared bitmaps
+ * @slab: pointer to bmslab
+ *
+ * We use hashing to randomly determine both the page index and submap index to
+ * reduce CAS contention. With BMSLAB_PLACEMENT_HOME the walk starts at the
+ * thread's home page and submap instead, which advance past each allocated
+ * slot, so that consecutive objects of a thread are adjacent in memory. From
+ * there, the page summary and the page's non-full submap mask lead to the next
+ * candidates, so full pages and submaps are never probed.
+ *
+ * If we find a free bit (0), we set it to 1 with a CAS. On success, compute the
+ * slot index => pointer and return. If the CAS filled the submap, its summary
+ * bit is cleared.
+ *
+ * If a slot is allocated, increment the used slot counter. If necessary,
+ * increase the number of physical pages. Keeping too few pages may increase the
+ * time complexity of allocation.
+ *
+ * If we exhaust all pages without success, return NULL.
+ */
+static void *__bmslab_alloc(struct bmslab *slab)
+{
+	struct page_cursor cursor;
+	struct bmslab_home *home = NULL;
+	uint32_t page_count, page_idx, online_gen;
+	uint32_t submap_start_idx, submap_idx, slot_idx, candidates;
+	_Atomic uint64_t *submaps;
+	int bit_idx;
+	uint64_t oldv, newv;
+	void *sp;
+
+	sp = __builtin_frame_address(0);
 	
 retry:
 
-	/* Distribute the cache-lines */
-	page_start_idx = murmurhash32(&sp, sizeof(sp), tls_murmur_seed++)
-		% slab->phys_page_count;
-	
-	for (uint32_t i = 0; i < slab->phys_page_count; i++) {
-		page_idx = (page_start_idx + i) % slab->phys_page_count;
+	online_gen = atomic_load(&slab->online_gen);
+	page_count = get_usable_page_count(slab);
+
+	if (slab->placement == BMSLAB_PLACEMENT_HOME) {
+		home = get_home(slab, page_count);
+		init_page_cursor(&cursor, home_start_page(slab, home, page_count),
+			page_count);
+	} else {
+		/* Distribute the cache-lines */
+		init_page_cursor(&cursor,
+			murmurhash32(&sp, sizeof(sp), tls_murmur_seed++) % page_count,
+			page_count);
+	}
+
+	while (next_nonfull_page(slab, &cursor, &page_idx)) {
+		/* If this page is locked, move to the next page */
+		if (is_page_locked(slab, page_idx))
+			continue;
+
+		/* Distribute the addresses within the cache-line */
+		submaps = page_submaps(slab, page_idx);
+		submap_start_idx = choose_submap_start(slab, home, page_idx, sp);
+		candidates
+			= rotated_nonfull_submaps(slab, page_idx, submap_start_idx);
+
+		while (candidates != 0) {
+			submap_idx = (submap_start_idx + __builtin_ctz(candidates))
+				& (slab->submap_count - 1);
+			candidates &= candidates - 1;
+			oldv = atomic_load(&submaps[submap_idx]);
+
+			/* Move to the next submap */
+			if (oldv == SUBMAP_FULL)
+				continue;
+
+			bit_idx = __builtin_ctzll(~oldv);
+
+			newv = oldv | (1ULL << bit_idx);
+			if (!atomic_compare_exchange_weak(&submaps[submap_idx],
+					&oldv, newv)) {
+				count_cas_failure(slab);
+			} else {
+				if (newv == SUBMAP_FULL)
+					mark_submap_full(slab, page_idx, submap_idx);
+
+				/*
+				 * The shrinker may have locked the page before our claim
+				 * became visible, see purge_empty_page().
+				 */
+				if (is_page_locked(slab, page_idx)) {
+					release_claim(slab, page_idx, submap_idx, 1ULL << bit_idx);
+					break;
+				}
+
+				if (oldv == slab->empty_submaps[submap_idx])
+					unmark_page_empty(slab, page_idx);
+
+				slot_idx = slot_index(slab, submap_idx, bit_idx);
+				assert(slot_idx < slab->slot_count_per_page);
+
+				if (home != NULL)
+					advance_home(slab, home, page_idx, submap_idx, bit_idx);
+
+				/*
+				 * Increase the global allocated slot counter and expand the
+				 * number of physical page if needed.
+				 */
+				add_slot_count(slab, 1);
+				adaptive_phys_page_expand(slab, false);
+
+				return slot_start(slab, page_idx, slot_idx);
+			}
+		}
+	}
+
+	if ((atomic_load(&slab->phys_page_count)
+			< atomic_load(&slab->page_limit) ||
+			atomic_load(&slab->purged_page_count) > 0) &&
+			adaptive_phys_page_expand(slab, true) != 0)
+		goto retry;
+
+	/* Pages added or reused while this pass was running were not scanned */
+	if (atomic_load(&slab->online_gen) != online_gen)
+		goto retry;
+
+	return NULL;
+}
+
+/*
+ * __bmslab_free - return an object pointer to the shared bitmaps
+ * @slab: pointer to bmslab
+ * @ptr: object pointer to free
+ *
+ * We compute page_idx from (ptr - slab->base_addr) >> page_shift, then slot_idx
+ * from ((ptr - page_start - page_colour) / slot_size).
+ *
+ * The submap and bit index come from slot_position(). Clear this bit (1->0)
+ * with fetch_and. If the submap was full, mark it non-full again.
+ * If the page is now empty, it becomes a purge candidate.
+ */
+static void __bmslab_free(struct bmslab *slab, void *ptr)
+{
+	uintptr_t base, diff, page_base;
+	uint32_t page_idx, submap_idx, slot_idx, bit_idx;
+	uint64_t oldv;
+	size_t offset;
+
+	base = (uintptr_t)slab->base_addr;
+	diff = (uintptr_t)ptr - base;
+
+	page_idx = diff >> slab->page_shift;
+	if (page_idx >= slab->virt_page_count) {
+		fprintf(stderr, "bmslab_free: invalid page_idx\n");
+		return;
+	}
+
+	page_base = base + ((uintptr_t)page_idx << slab->page_shift);
+	offset = (uintptr_t)ptr - page_base - page_colour(slab, page_idx);
+
+	slot_idx = (int)(offset / slab->slot_size);
+	assert(slot_idx < slab->slot_count_per_page);
+
+	slot_position(slab, slot_idx, &submap_idx, &bit_idx);
+
+	oldv = atomic_fetch_and(&page_submaps(slab, page_idx)[submap_idx],
+		~(1ULL << bit_idx));
+	if (oldv == SUBMAP_FULL)
+		mark_submap_nonfull(slab, page_idx, submap_idx);
+
+	add_slot_count(slab, -1);
+
+	/* The page can only have become empty if this submap did */
+	if ((oldv & ~(1ULL << bit_idx)) == slab->empty_submaps[submap_idx])
+		mark_page_empty(slab, page_idx);
+
+	if (!slab->background_reclaim)
+		adaptive_phys_page_shrink(slab);
+}
+
+/*
+ * claim_submap_bits - claim up to @want free bits of a submap with one CAS
+ * @slab: pointer to bmslab
+ * @page_idx: page of the submap
+ * @submap_idx: target submap
+ * @want: maximum number of bits to claim
+ * @filled: set to true if the claim filled the submap
+ * @was_empty: set to true if the submap was empty before the claim
+ *
+ * Returns the mask of the claimed bits, or 0 if the submap is full.
+ */
+static uint64_t claim_submap_bits(struct bmslab *slab, uint32_t page_idx,
+	uint32_t submap_idx, int want, bool *filled, bool *was_empty)
+{
+	_Atomic uint64_t *submap = &page_submaps(slab, page_idx)[submap_idx];
+	uint64_t oldv = atomic_load(submap), newv, free_bits, claim;
+	int k;
+
+	*filled = false;
+
+	for (;;) {
+		if (oldv == SUBMAP_FULL)
+			return 0;
+
+		free_bits = ~oldv;
+		claim = 0;
+
+		for (k = 0; k < want && free_bits != 0; k++) {
+			claim |= free_bits & -free_bits;
+			free_bits &= free_bits - 1;
+		}
+
+		newv = oldv | claim;
+		if (atomic_compare_exchange_weak(submap, &oldv, newv))
+			break;
+
+		count_cas_failure(slab);
+	}
+
+	*filled = (newv == SUBMAP_FULL);
+	if (oldv == slab->empty_submaps[submap_idx])
+		*was_empty = true;
+	return claim;
+}
+
+/*
+ * __bmslab_alloc_bulk - allocate several objects from the shared bitmaps
+ * @slab: pointer to bmslab
+ * @out: array to store the allocated objects
+ * @n: number of objects to allocate
+ *
+ * Same page and submap selection as __bmslab_alloc(), but every CAS claims as
+ * many free bits of the submap as are still needed. The page lock is checked
+ * once after all claims on a page, and if the page got locked they are all
+ * given back. The allocated slot counter is updated once for the whole batch.
+ *
+ * Returns the number of allocated objects, which is less than @n only if the
+ * slab is exhausted.
+ */
+static int __bmslab_alloc_bulk(struct bmslab *slab, void **out, int n)
+{
+	struct page_cursor cursor;
+	struct bmslab_home *home = NULL;
+	uint32_t page_idx, pass_page_count, pass_online_gen;
+	uint32_t submap_start_idx, submap_idx, slot_idx, candidates;
+	uint64_t claim, claims[SUBMAP_MAX_COUNT];
+	int bit_idx, got = 0, pass_got, page_got;
+	bool filled, was_empty;
+	void *sp;
+
+	sp = __builtin_frame_address(0);
+
+retry:
+
+	pass_got = got;
+	pass_online_gen = atomic_load(&slab->online_gen);
+	pass_page_count = get_usable_page_count(slab);
+
+	if (slab->placement == BMSLAB_PLACEMENT_HOME) {
+		home = get_home(slab, pass_page_count);
+		init_page_cursor(&cursor,
+			home_start_page(slab, home, pass_page_count), pass_page_count);
+	} else {
+		init_page_cursor(&cursor,
+			murmurhash32(&sp, sizeof(sp), tls_murmur_seed++) % pass_page_count,
+			pass_page_count);
+	}
+
+	while (got < n && next_nonfull_page(slab, &cursor, &page_idx)) {
+		if (is_page_locked(slab, page_idx))
+			continue;
+
+		page_got = 0;
+		was_empty = false;
+		memset(claims, 0, sizeof(claims));
+		submap_start_idx = choose_submap_start(slab, home, page_idx, sp);
+		candidates
+			= rotated_nonfull_submaps(slab, page_idx, submap_start_idx);
+
+		while (candidates != 0 && got < n) {
+			submap_idx = (submap_start_idx + __builtin_ctz(candidates))
+				& (slab->submap_count - 1);
+			candidates &= candidates - 1;
+			claim = claim_submap_bits(slab, page_idx, submap_idx, n - got,
+				&filled, &was_empty);
+
+			if (filled)
+				mark_submap_full(slab, page_idx, submap_idx);
+
+			claims[submap_idx] |= claim;
+
+			while (claim != 0) {
+				bit_idx = __builtin_ctzll(claim);
+				claim &= claim - 1;
+
+				slot_idx = slot_index(slab, submap_idx, bit_idx);
+				assert(slot_idx < slab->slot_count_per_page);
+
+				out[got++] = slot_start(slab, page_idx, slot_idx);
+				page_got++;
+			}
+		}
+
+		if (page_got == 0)
+			continue;
+
+		/* Same validation as __bmslab_alloc(), once for all claims */
+		if (is_page_locked(slab, page_idx)) {
+			for (submap_idx = 0; submap_idx < slab->submap_count;
+					submap_idx++) {
+				if (claims[submap_idx] != 0)
+					release_claim(slab, page_idx, submap_idx,
+						claims[submap_idx]);
+			}
+			got -= page_got;
+			continue;
+		}
+
+		if (was_empty)
+			unmark_page_empty(slab, page_idx);
+
+		if (home != NULL)
+			home->page_idx = page_idx;
+	}
+
+	if (got > pass_got) {
+		add_slot_count(slab, got - pass_got);
+		adaptive_phys_page_expand(slab, false);
+	}
+
+	if (got < n) {
+		if ((atomic_load(&slab->phys_page_count)
+				< atomic_load(&slab->page_limit) ||
+				atomic_load(&slab->purged_page_count) > 0) &&
+				adaptive_phys_page_expand(slab, true) != 0)
+			goto retry;
+
+		/*
+		 * Pages added or reused while this pass was running, including by
+		 * the expand above, were not scanned
+		 */
+		if (atomic_load(&slab->online_gen) != pass_online_gen)
+			goto retry;
+	}
+
+	return got;
+}
+
+/*
+ * bulk_free_page - pending frees of one page in __bmslab_free_bulk()
+ * @page_idx: page index
+ * @masks: bits to clear for each submap
+ */
+struct bulk_free_page {
+	uint32_t page_idx;
+	uint64_t masks[SUBMAP_MAX_COUNT];
+};
+
+static void flush_bulk_free_pages(struct bmslab *slab,
+	struct bulk_free_page *pages, int page_count)
+{
+	uint64_t oldv;
+	bool emptied;
+
+	for (int i = 0; i < page_count; i++) {
+		emptied = false;
 
-		/* If this page is locked, move to the next page */
-		if (!try_ref_page(slab, page_idx))
-			continue;
+		for (uint32_t j = 0; j < slab->submap_count; j++) {
+			if (pages[i].masks[j] == 0)
+				continue;
 
-		/* Distribute the addresses within the cache-line */
-		submap_start_idx
-			= murmurhash32(&sp, sizeof(sp), tls_murmur_seed++) % SUBMAP_COUNT;
+			oldv = atomic_fetch_and(
+				&page_submaps(slab, pages[i].page_idx)[j],
+				~pages[i].masks[j]);
+			if (oldv == SUBMAP_FULL)
+				mark_submap_nonfull(slab, pages[i].page_idx, j);
+			if ((oldv & ~pages[i].masks[j]) == slab->empty_submaps[j])
+				emptied = true;
+		}
 
-		for (uint32_t sub_i = 0; sub_i < SUBMAP_COUNT; sub_i++) {
-			submap_idx = (submap_start_idx + sub_i) % SUBMAP_COUNT;
-			oldv = atomic_load(&slab->bitmaps[page_idx].submap[submap_idx]);
+		if (emptied)
+			mark_page_empty(slab, pages[i].page_idx);
+	}
+}
 
-			/* Move to the next submap */
-			if (oldv == 0xFFFFFFFFU)
-				continue;
+/*
+ * __bmslab_free_bulk - return several objects to the shared bitmaps
+ * @slab: pointer to bmslab
+ * @ptrs: objects to free
+ * @n: number of objects
+ *
+ * Pointers are grouped by page in a small table. Each flush of the table issues
+ * one atomic_fetch_and per touched submap and one emptiness check per page
+ * whose submap became empty. The allocated slot counter is updated, and
+ * shrinking is attempted, once for the whole batch.
+ */
+static void __bmslab_free_bulk(struct bmslab *slab, void **ptrs, int n)
+{
+	struct bulk_free_page pages[BULK_FREE_PAGE_COUNT];
+	int page_count = 0, cur = 0, freed = 0;
+	uintptr_t base = (uintptr_t)slab->base_addr, diff;
+	uint32_t page_idx, slot_idx, submap_idx, bit_idx;
 
-			bit_idx = __builtin_ctz(~oldv);
-			if (bit_idx < 0 || bit_idx >= 32)
-				continue;
+	for (int i = 0; i < n; i++) {
+		if (ptrs[i] == NULL)
+			continue;
 
-			newv = oldv | (1U << bit_idx);
-			if (atomic_compare_exchange_weak(
-					&slab->bitmaps[page_idx].submap[submap_idx],
-					&oldv, newv)) {
-				slot_idx = bit_idx * SUBMAP_COUNT + submap_idx;
-				assert(slot_idx < slab->slot_count_per_page);
+		diff = (uintptr_t)ptrs[i] - base;
+		page_idx = diff >> slab->page_shift;
+		if (page_idx >= slab->virt_page_count) {
+			fprintf(stderr, "bmslab_free_bulk: invalid page_idx\n");
+			continue;
+		}
 
-				/*
-				 * Increase the global allocated slot counter and expand the
-				 * number of physical page if needed.
-				 */
-				atomic_fetch_add(&slab->allocated_slot_count, 1U);
-				adaptive_phys_page_expand(slab);
+		slot_idx = (uint32_t)(((diff & (slab->page_size - 1))
+			- page_colour(slab, page_idx)) / slab->slot_size);
+		assert(slot_idx < slab->slot_count_per_page);
+
+		/* Consecutive pointers usually share the page */
+		if (page_count == 0 || pages[cur].page_idx != page_idx) {
+			for (cur = 0; cur < page_count; cur++) {
+				if (pages[cur].page_idx == page_idx)
+					break;
+			}
+
+			if (cur == BULK_FREE_PAGE_COUNT) {
+				flush_bulk_free_pages(slab, pages, page_count);
+				page_count = cur = 0;
+			}
 
-				return (void *)((char *)page_start(slab, page_idx)
-					+ slot_idx * slab->obj_size);
+			if (cur == page_count) {
+				memset(&pages[cur], 0, sizeof(struct bulk_free_page));
+				pages[cur].page_idx = page_idx;
+				page_count++;
 			}
 		}
 
-		/* Move to the next page */
-		atomic_fetch_sub(&slab->page_lock_refs[page_idx], 1U);
+		slot_position(slab, slot_idx, &submap_idx, &bit_idx);
+		pages[cur].masks[submap_idx] |= 1ULL << bit_idx;
+		freed++;
 	}
 
-	if (atomic_load(&slab->phys_page_count)
-		< atomic_load(&slab->virt_page_count)) {
-		adaptive_phys_page_expand(slab);
-		goto retry;
+	flush_bulk_free_pages(slab, pages, page_count);
+
+	if (freed > 0) {
+		add_slot_count(slab, -freed);
+		if (!slab->background_reclaim)
+			adaptive_phys_page_shrink(slab);
+	}
+}
+
+/*
+ * magazine_key_destructor - drain the exiting thread's magazines
+ * @arg: head of the exiting thread's magazine list
+ *
+ * Cached objects are returned to slabs that are still alive. Magazines whose
+ * slab has already been destroyed are simply released.
+ */
+static void magazine_key_destructor(void *arg)
+{
+	struct bmslab_magazine *mag = arg, *next;
+	struct bmslab *slab;
+
+	pthread_mutex_lock(&magazine_lock);
+	for (; mag != NULL; mag = next) {
+		next = mag->thread_next;
+		slab = atomic_load(&mag->slab);
+
+		if (slab != NULL) {
+			__bmslab_free_bulk(slab, mag->objs, mag->count);
+
+			*mag->slab_pprev = mag->slab_next;
+			if (mag->slab_next != NULL)
+				mag->slab_next->slab_pprev = mag->slab_pprev;
+		}
+
+		free(mag);
 	}
+	pthread_mutex_unlock(&magazine_lock);
 
-	return NULL;
+	tls_magazines = NULL;
+	tls_last_magazine = NULL;
+}
+
+static void magazine_key_init(void)
+{
+	pthread_key_create(&magazine_key, magazine_key_destructor);
 }
 
 /*
- * bmslab_free - frees an object pointer
+ * find_magazine_slow - find or create the calling thread's magazine
+ * @slab: pointer to bmslab
+ *
+ * Walk the thread's magazine list and release the magazines of destroyed slabs
+ * on the way. If no magazine exists for @slab, create one and link it to both
+ * the slab and the thread.
+ *
+ * Returns NULL if the magazine could not be created.
+ */
+static struct bmslab_magazine *find_magazine_slow(struct bmslab *slab)
+{
+	struct bmslab_magazine **link = &tls_magazines, *mag;
+	struct bmslab *owner;
+	bool released = false;
+
+	while ((mag = *link) != NULL) {
+		owner = atomic_load_explicit(&mag->slab, memory_order_relaxed);
+
+		if (owner == slab)
+			break;
+
+		if (owner == NULL) {
+			if (tls_last_magazine == mag)
+				tls_last_magazine = NULL;
+			*link = mag->thread_next;
+			free(mag);
+			released = true;
+			continue;
+		}
+
+		link = &mag->thread_next;
+	}
+
+	/* The key must always hold the current list head for the destructor */
+	if (released)
+		pthread_setspecific(magazine_key, tls_magazines);
+
+	if (mag != NULL) {
+		tls_last_magazine = mag;
+		return mag;
+	}
+
+	pthread_once(&magazine_key_once, magazine_key_init);
+
+	mag = malloc(sizeof(struct bmslab_magazine)
+		+ slab->magazine_size * sizeof(void *));
+	if (mag == NULL)
+		return NULL;
+
+	mag->count = 0;
+	mag->capacity = slab->magazine_size;
+	atomic_init(&mag->slab, slab);
+
+	pthread_mutex_lock(&magazine_lock);
+	mag->slab_next = slab->magazines;
+	mag->slab_pprev = &slab->magazines;
+	if (slab->magazines != NULL)
+		slab->magazines->slab_pprev = &mag->slab_next;
+	slab->magazines = mag;
+	pthread_mutex_unlock(&magazine_lock);
+
+	mag->thread_next = tls_magazines;
+	tls_magazines = mag;
+	pthread_setspecific(magazine_key, tls_magazines);
+
+	tls_last_magazine = mag;
+	return mag;
+}
+
+static inline struct bmslab_magazine *find_magazine(struct bmslab *slab)
+{
+	struct bmslab_magazine *mag = tls_last_magazine;
+
+	if (mag != NULL &&
+			atomic_load_explicit(&mag->slab, memory_order_relaxed) == slab)
+		return mag;
+
+	return find_magazine_slow(slab);
+}
+
+/*
+ * bmslab_enable_magazine - enable per-thread magazines
+ * @slab: pointer to bmslab
+ * @size: maximum number of objects cached per thread (1 ~ 1024)
+ *
+ * Must be called before the slab is shared with other threads. Objects cached
+ * in magazines are still counted as allocated slots.
+ *
+ * Returns 0 on success, or -1 on failure.
+ */
+int bmslab_enable_magazine(struct bmslab *slab, int size)
+{
+	if (slab == NULL || size <= 0 || size > MAGAZINE_MAX_SIZE) {
+		fprintf(stderr, "bmslab_enable_magazine: invalid size\n");
+		return -1;
+	}
+
+	slab->magazine_size = size;
+	return 0;
+}
+
+/*
+ * bmslab_alloc - allocate one object from bmslab
  * @slab: pointer to bmslab
+ *
+ * If magazines are enabled, pop an object from the calling thread's magazine.
+ * An empty magazine is refilled with half of its capacity from the shared
+ * bitmaps, so that alloc/free oscillation around the boundary does not touch
+ * them on every call.
+ *
+ * Returns NULL if the slab is exhausted.
+ */
+void *bmslab_alloc(struct bmslab *slab)
+{
+	struct bmslab_magazine *mag;
+
+	if (slab == NULL)
+		return NULL;
+
+	if (slab->magazine_size == 0 || (mag = find_magazine(slab)) == NULL)
+		return __bmslab_alloc(slab);
+
+	if (mag->count == 0) {
+		mag->count = __bmslab_alloc_bulk(slab, mag->objs,
+			(mag->capacity + 1) >> 1);
+
+		if (mag->count == 0)
+			return NULL;
+	}
+
+	return mag->objs[--mag->count];
+}
+
+/*
+ * bmslab_owner - find the slab an object belongs to
+ * @ptr: object pointer, or any address
+ *
+ * Every slab registers the 2 MiB regions of its mapping in a process-wide
+ * table, so this is two loads and needs no lock. Addresses outside of all
+ * slabs map to NULL.
+ *
+ * Returns the owning slab, or NULL.
+ */
+struct bmslab *bmslab_owner(const void *ptr)
+{
+	uintptr_t region = (uintptr_t)ptr >> REGION_SHIFT;
+	struct bmslab_registry_leaf *leaf;
+
+	if (region >> (REGISTRY_ROOT_BITS + REGISTRY_LEAF_BITS))
+		return NULL;
+
+	leaf = atomic_load_explicit(&registry[region >> REGISTRY_LEAF_BITS],
+		memory_order_acquire);
+	if (leaf == NULL)
+		return NULL;
+
+	return atomic_load_explicit(
+		&leaf->slabs[region & ((1 << REGISTRY_LEAF_BITS) - 1)],
+		memory_order_acquire);
+}
+
+/*
+ * bmslab_free_any - frees an object pointer without its slab
  * @ptr: object pointer to free
  *
- * We compute page_idx from (ptr - slab->base_addr) >> PAGE_SHIFT, then slot_idx
- * from ((ptr - page_start) / obj_size).
+ * The slab is found with bmslab_owner(), then the object is freed as in
+ * bmslab_free().
+ */
+void bmslab_free_any(void *ptr)
+{
+	struct bmslab *slab;
+
+	if (ptr == NULL)
+		return;
+
+	slab = bmslab_owner(ptr);
+	if (slab == NULL) {
+		fprintf(stderr, "bmslab_free_any: pointer not owned by any slab\n");
+		return;
+	}
+
+	bmslab_free(slab, ptr);
+}
+
+/*
+ * bmslab_free - frees an object pointer
+ * @slab: pointer to bmslab
+ * @ptr: object pointer to free
  *
- * The submap index is (slot_idx % 16), bit index is (slot_idx / 16). Clear this
- * bit (1->0) with fetch_and.
+ * If magazines are enabled, push the object to the calling thread's magazine.
+ * A full magazine first returns half of its objects to the shared bitmaps.
  */
 void bmslab_free(struct bmslab *slab, void *ptr)
 {
-	uintptr_t base, diff, page_base;
-	uint32_t page_idx, submap_idx, slot_idx, bit_idx;
-	size_t offset;
+	struct bmslab_magazine *mag;
+	uintptr_t diff;
 
 	if (slab == NULL || ptr == NULL)
 		return;
 
-	base = (uintptr_t)slab->base_addr;
-	diff = (uintptr_t)ptr - base;
+	if (slab->magazine_size == 0 || (mag = find_magazine(slab)) == NULL) {
+		__bmslab_free(slab, ptr);
+		return;
+	}
 
-	page_idx = diff >> PAGE_SHIFT;
-	if (page_idx >= slab->virt_page_count) {
+	diff = (uintptr_t)ptr - (uintptr_t)slab->base_addr;
+	if ((diff >> slab->page_shift) >= slab->virt_page_count) {
 		fprintf(stderr, "bmslab_free: invalid page_idx\n");
 		return;
 	}
 
-	page_base = base + (page_idx << PAGE_SHIFT);
-	offset = (uintptr_t)ptr - page_base;
+	if (mag->count == mag->capacity) {
+		__bmslab_free_bulk(slab, &mag->objs[mag->capacity >> 1],
+			mag->count - (mag->capacity >> 1));
+		mag->count = mag->capacity >> 1;
+	}
+
+	mag->objs[mag->count++] = ptr;
+}
 
-	slot_idx = (int)(offset / slab->obj_size);
-	assert(slot_idx < slab->slot_count_per_page);
+/*
+ * bmslab_alloc_bulk - allocate several objects from bmslab
+ * @slab: pointer to bmslab
+ * @out: array to store the allocated objects
+ * @n: number of objects to allocate
+ *
+ * Objects cached in the calling thread's magazine are handed out first. The
+ * rest are claimed from the shared bitmaps several bits per CAS.
+ *
+ * Returns the number of allocated objects, which is less than @n only if the
+ * slab is exhausted.
+ */
+int bmslab_alloc_bulk(struct bmslab *slab, void **out, int n)
+{
+	struct bmslab_magazine *mag;
+	int got = 0;
+
+	if (slab == NULL || out == NULL || n <= 0)
+		return 0;
+
+	if (slab->magazine_size != 0 && (mag = find_magazine(slab)) != NULL) {
+		while (got < n && mag->count > 0)
+			out[got++] = mag->objs[--mag->count];
+	}
+
+	if (got < n)
+		got += __bmslab_alloc_bulk(slab, out + got, n - got);
+
+	return got;
+}
+
+/*
+ * bmslab_free_bulk - frees several object pointers
+ * @slab: pointer to bmslab
+ * @ptrs: objects to free, NULL entries are ignored
+ * @n: number of objects
+ *
+ * Free slots of the calling thread's magazine are filled first. The rest are
+ * returned to the shared bitmaps, coalesced per page and submap.
+ */
+void bmslab_free_bulk(struct bmslab *slab, void **ptrs, int n)
+{
+	struct bmslab_magazine *mag;
+	uintptr_t diff;
+	int i = 0;
+
+	if (slab == NULL || ptrs == NULL || n <= 0)
+		return;
+
+	if (slab->magazine_size != 0 && (mag = find_magazine(slab)) != NULL) {
+		for (; i < n && mag->count < mag->capacity; i++) {
+			if (ptrs[i] == NULL)
+				continue;
+
+			diff = (uintptr_t)ptrs[i] - (uintptr_t)slab->base_addr;
+			if ((diff >> slab->page_shift) >= slab->virt_page_count) {
+				fprintf(stderr, "bmslab_free_bulk: invalid page_idx\n");
+				continue;
+			}
+
+			mag->objs[mag->count++] = ptrs[i];
+		}
+	}
+
+	if (i < n)
+		__bmslab_free_bulk(slab, ptrs + i, n - i);
+}
+
+/*
+ * Default size classes, jemalloc-like spacing: 16 bytes apart up to 128 and
+ * then four classes per doubling.
+ */
+static const int default_class_sizes[] = {
+	8, 16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256, 320, 384, 448, 512,
+	640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+	2560, 3072, 3584, 4096
+};
+
+/*
+ * bmslab_multi_range - address range of one class slab
+ * @start: first address of the slab
+ * @end: one past the last address of the slab
+ * @slab: owning slab
+ */
+struct bmslab_multi_range {
+	uintptr_t start;
+	uintptr_t end;
+	struct bmslab *slab;
+};
+
+/*
+ * bmslab_multi - set of slabs, one per size class
+ * @class_count: number of size classes
+ * @max_size: largest size class
+ * @size_class: class index of each size, indexed by (size + 7) >> 3
+ * @slabs: slab of each size class
+ * @ranges: address ranges of the slabs, sorted by start address
+ */
+struct bmslab_multi {
+	uint32_t class_count;
+	uint32_t max_size;
+	uint8_t size_class[(PAGE_SIZE >> MULTI_CLASS_SHIFT) + 1];
+	struct bmslab *slabs[MULTI_MAX_CLASS_COUNT];
+	struct bmslab_multi_range ranges[MULTI_MAX_CLASS_COUNT];
+};
+
+/*
+ * bmslab_multi_init - initializes a set of size class slabs
+ * @class_sizes: ascending object sizes, multiples of 8 within 8 ~ PAGE_SIZE.
+ *               NULL selects the default table.
+ * @class_count: number of entries in @class_sizes
+ * @max_page_count: max_page_count of each class slab
+ *
+ * Returns pointer to a bmslab_multi on success, or NULL on failure.
+ */
+struct bmslab_multi *bmslab_multi_init(const int *class_sizes, int class_count,
+	int max_page_count)
+{
+	struct bmslab_multi *multi;
+	struct bmslab_multi_range range;
+	int class_idx = 0, i, j;
+
+	if (class_sizes == NULL) {
+		class_sizes = default_class_sizes;
+		class_count = sizeof(default_class_sizes) / sizeof(int);
+	}
+
+	if (class_count <= 0 || class_count > MULTI_MAX_CLASS_COUNT) {
+		fprintf(stderr, "bmslab_multi_init: invalid class_count\n");
+		return NULL;
+	}
+
+	for (i = 0; i < class_count; i++) {
+		if (class_sizes[i] < 8 || class_sizes[i] > PAGE_SIZE ||
+				(class_sizes[i] & ((1 << MULTI_CLASS_SHIFT) - 1)) != 0 ||
+				(i > 0 && class_sizes[i] <= class_sizes[i - 1])) {
+			fprintf(stderr, "bmslab_multi_init: invalid class_sizes\n");
+			return NULL;
+		}
+	}
+
+	multi = calloc(1, sizeof(struct bmslab_multi));
+	if (multi == NULL) {
+		fprintf(stderr, "bmslab_multi_init: multi allocation failed\n");
+		return NULL;
+	}
+
+	multi->class_count = class_count;
+	multi->max_size = class_sizes[class_count - 1];
+
+	for (i = 0; i < class_count; i++) {
+		multi->slabs[i] = bmslab_init(class_sizes[i], max_page_count);
+		if (multi->slabs[i] == NULL) {
+			bmslab_multi_destroy(multi);
+			return NULL;
+		}
+
+		multi->ranges[i].start = (uintptr_t)multi->slabs[i]->base_addr;
+		multi->ranges[i].end = multi->ranges[i].start
+			+ ((uintptr_t)multi->slabs[i]->virt_page_count
+				<< multi->slabs[i]->page_shift);
+		multi->ranges[i].slab = multi->slabs[i];
+	}
+
+	/* Smallest class that fits each 8-byte step */
+	for (i = 0; i <= (int)(multi->max_size >> MULTI_CLASS_SHIFT); i++) {
+		while ((i << MULTI_CLASS_SHIFT) > class_sizes[class_idx])
+			class_idx++;
+		multi->size_class[i] = class_idx;
+	}
+
+	/* Sort the ranges by address for bmslab_multi_free() */
+	for (i = 1; i < class_count; i++) {
+		range = multi->ranges[i];
+		for (j = i; j > 0 && multi->ranges[j - 1].start > range.start; j--)
+			multi->ranges[j] = multi->ranges[j - 1];
+		multi->ranges[j] = range;
+	}
+
+	return multi;
+}
+
+/*
+ * bmslab_multi_destroy - frees the bmslab_multi and all of its slabs
+ * @multi: pointer to bmslab_multi
+ */
+void bmslab_multi_destroy(struct bmslab_multi *multi)
+{
+	if (multi == NULL)
+		return;
+
+	for (uint32_t i = 0; i < multi->class_count; i++)
+		bmslab_destroy(multi->slabs[i]);
+
+	free(multi);
+}
+
+/*
+ * bmslab_multi_alloc - allocate an object of at least @size bytes
+ * @multi: pointer to bmslab_multi
+ * @size: requested size
+ *
+ * Returns NULL if @size is larger than the largest class or the class slab is
+ * exhausted.
+ */
+void *bmslab_multi_alloc(struct bmslab_multi *multi, size_t size)
+{
+	if (multi == NULL || size > multi->max_size)
+		return NULL;
+
+	return bmslab_alloc(multi->slabs[multi->size_class[
+		(size + (1 << MULTI_CLASS_SHIFT) - 1) >> MULTI_CLASS_SHIFT]]);
+}
 
-	submap_idx = slot_idx % SUBMAP_COUNT;
-	bit_idx = slot_idx / SUBMAP_COUNT;
+/*
+ * bmslab_multi_alloc_aligned - allocate an object with a given alignment
+ * @multi: pointer to bmslab_multi
+ * @size: requested size
+ * @align: required alignment, a power of two
+ *
+ * Class slots are spaced by the class size from a page aligned start, so only
+ * a class whose size is a multiple of @align returns aligned objects. The
+ * smallest such class that fits @size is used.
+ *
+ * Returns NULL if @align is not a power of two, no class fits, or the class
+ * slab is exhausted.
+ */
+void *bmslab_multi_alloc_aligned(struct bmslab_multi *multi, size_t size,
+	size_t align)
+{
+	uint32_t class_idx;
 
-	atomic_fetch_and(&slab->bitmaps[page_idx].submap[submap_idx],
-		~(1U << bit_idx));
+	if (multi == NULL || size > multi->max_size ||
+			align == 0 || (align & (align - 1)) != 0)
+		return NULL;
 
-	atomic_fetch_sub(&slab->allocated_slot_count, 1U);
+	class_idx = multi->size_class[
+		(size + (1 << MULTI_CLASS_SHIFT) - 1) >> MULTI_CLASS_SHIFT];
+	while (class_idx < multi->class_count &&
+			(multi->slabs[class_idx]->slot_size & (align - 1)) != 0)
+		class_idx++;
 
-	atomic_fetch_sub(&slab->page_lock_refs[page_idx], 1);
+	if (class_idx == multi->class_count)
+		return NULL;
 
-	adaptive_phys_page_shrink(slab);
+	return bmslab_alloc(multi->slabs[class_idx]);
 }
 
+/*
+ * find_multi_slab - find the class slab that owns @ptr
+ * @multi: pointer to bmslab_multi
+ * @ptr: object pointer
+ *
+ * Returns NULL if no class slab contains @ptr.
+ */
+static struct bmslab *find_multi_slab(struct bmslab_multi *multi, void *ptr)
+{
+	uintptr_t addr = (uintptr_t)ptr;
+	uint32_t lo = 0, hi = multi->class_count, mid;
+
+	/* Last range that starts at or before addr */
+	while (hi - lo > 1) {
+		mid = (lo + hi) >> 1;
+		if (multi->ranges[mid].start <= addr)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	if (addr < multi->ranges[lo].start || addr >= multi->ranges[lo].end)
+		return NULL;
+
+	return multi->ranges[lo].slab;
+}
 
+/*
+ * bmslab_multi_free - frees an object allocated by bmslab_multi_alloc()
+ * @multi: pointer to bmslab_multi
+ * @ptr: object pointer to free
+ *
+ * The owning class is found from the address alone, so the caller does not
+ * have to remember the size.
+ */
+void bmslab_multi_free(struct bmslab_multi *multi, void *ptr)
+{
+	struct bmslab *slab;
 
+	if (multi == NULL || ptr == NULL)
+		return;
 
+	slab = find_multi_slab(multi, ptr);
+	if (slab == NULL) {
+		fprintf(stderr, "bmslab_multi_free: invalid ptr\n");
+		return;
+	}
 
+	bmslab_free(slab, ptr);
+}
@@ -4,19 +4,112 @@
 extern "C" {
 #endif /* __cplusplus */
 
+#include <stddef.h>
+
 typedef struct bmslab bmslab_t;
+typedef struct bmslab_multi bmslab_multi_t;
+
+enum bmslab_growth {
+	BMSLAB_GROWTH_FIXED,		/* growth_step pages per expansion */
+	BMSLAB_GROWTH_PROPORTIONAL,	/* growth_step percent of resident pages */
+	BMSLAB_GROWTH_EXPONENTIAL,	/* double the resident pages */
+};
+
+enum bmslab_purge {
+	BMSLAB_PURGE_FREE,		/* MADV_FREE, reclaimed under memory pressure */
+	BMSLAB_PURGE_DONTNEED,	/* MADV_DONTNEED, reclaimed immediately */
+};
+
+enum bmslab_simd {
+	BMSLAB_SIMD_AUTO,		/* default, currently BMSLAB_SIMD_SCALAR */
+	BMSLAB_SIMD_SCALAR,		/* per-page non-full mask, no vector code */
+	BMSLAB_SIMD_SSE2,
+	BMSLAB_SIMD_AVX2,
+	BMSLAB_SIMD_AVX512,
+};
+
+enum bmslab_placement {
+	BMSLAB_PLACEMENT_HASH,	/* random page and submap per allocation */
+	BMSLAB_PLACEMENT_HOME,	/* per-thread home page, filled sequentially */
+};
+
+/* Zero fields select the defaults of bmslab_init() */
+struct bmslab_config {
+	int obj_size;
+	int max_page_count;
+	int expand_threshold;	/* percent of resident slots, default 50 */
+	int shrink_threshold;	/* percent of resident slots, 0 means 1/8 */
+	int growth;				/* enum bmslab_growth */
+	int growth_step;		/* default 1 page, or 25 percent */
+	int min_resident_pages;	/* online at init and never purged, default 1 */
+	int shrink_hysteresis;	/* empty pages kept before purging one */
+	int purge_method;		/* enum bmslab_purge */
+	int huge_page;			/* back the slab with 2 MiB pages */
+	int background_reclaim;	/* shrink from the reclaimer thread, not free */
+	int decay_ms;			/* purge empty pages gradually over this time */
+	int placement;			/* enum bmslab_placement */
+	int cacheline_layout;	/* claim a cache line of slots via one submap */
+	int slot_align;			/* boundary no slot crosses, e.g. 64, 0 packs */
+	int colouring;			/* rotate slot 0 of pages over cache lines */
+	int page_size;			/* slab page size, power of two 4 KiB ~ 256 KiB */
+	int reserve_page_count;	/* pages reserved for bmslab_set_limit() */
+};
 
 bmslab_t *bmslab_init(int obj_size, int max_page_count);
 
+bmslab_t *bmslab_init_ex(const struct bmslab_config *config);
+
+bmslab_t *bmslab_init_hugepage(int obj_size, int max_page_count);
+
 void bmslab_destroy(bmslab_t *slab);
 
 void *bmslab_alloc(bmslab_t *slab);
 
 void bmslab_free(bmslab_t *slab, void *ptr);
 
+bmslab_t *bmslab_owner(const void *ptr);
+
+void bmslab_free_any(void *ptr);
+
+int bmslab_alloc_bulk(bmslab_t *slab, void **out, int n);
+
+void bmslab_free_bulk(bmslab_t *slab, void **ptrs, int n);
+
+int bmslab_enable_magazine(bmslab_t *slab, int size);
+
+int bmslab_set_reclaim_interval(int interval_ms);
+
+int bmslab_set_simd(int level);
+
+int bmslab_set_limit(bmslab_t *slab, int max_page_count);
+
+/* size classes */
+bmslab_multi_t *bmslab_multi_init(const int *class_sizes, int class_count,
+	int max_page_count);
+
+void bmslab_multi_destroy(bmslab_multi_t *multi);
+
+void *bmslab_multi_alloc(bmslab_multi_t *multi, size_t size);
+
+void *bmslab_multi_alloc_aligned(bmslab_multi_t *multi, size_t size,
+	size_t align);
+
+void bmslab_multi_free(bmslab_multi_t *multi, void *ptr);
+
 /* stat */
 int get_bmslab_phys_page_count(struct bmslab *slab);
+int get_bmslab_page_limit(struct bmslab *slab);
 int get_bmslab_allocated_slots(struct bmslab *slab);
+int get_bmslab_page_size(struct bmslab *slab);
+int get_bmslab_slot_size(struct bmslab *slab);
+int get_bmslab_slot_count_per_page(struct bmslab *slab);
+int get_bmslab_colour_count(struct bmslab *slab);
+int get_bmslab_submap_count(struct bmslab *slab);
+int get_bmslab_huge_page_size(struct bmslab *slab);
+int get_bmslab_dirty_page_count(struct bmslab *slab);
+int get_bmslab_purged_page_count(struct bmslab *slab);
+long long get_bmslab_cas_failures(struct bmslab *slab);
+int get_bmslab_simd(void);
 
 #ifdef __cplusplus
 }
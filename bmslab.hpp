@@ -0,0 +1,303 @@
+/*
+ * bmslab.hpp: header-only C++ interface of bmslab
+ *
+ * - bmslabpp::pool<T>: a slab sized for T that lives as long as the pool,
+ *   constructing objects in place and handing them out as std::unique_ptr.
+ * - bmslabpp::multi: a bmslab_multi owned for the object's lifetime.
+ * - bmslabpp::allocator<T>: std::allocator compatible allocator over a
+ *   bmslab_multi, for the nodes of std::list, std::map, unordered_map, ...
+ * - bmslabpp::resource: std::pmr::memory_resource over a bmslab_multi.
+ *
+ * The allocator and the resource allocate with bmslab_multi_alloc_aligned(),
+ * fall back to ::operator new or an upstream resource for sizes and alignments
+ * the size classes do not serve, and tell the two apart on deallocation with
+ * bmslab_owner(). The namespace is not
+ * called bmslab, as that already names the C struct.
+ */
+#ifndef BMSLAB_HPP
+#define BMSLAB_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+#include "bmslab.h"
+
+namespace bmslabpp {
+
+/*
+ * pool - typed slab for objects of type T
+ *
+ * Slots are sizeof(T) apart from an aligned page start, and sizeof(T) is a
+ * multiple of alignof(T), so every slot is suitably aligned for T.
+ */
+template <typename T>
+class pool {
+	static_assert(sizeof(T) <= 64 * 1024, "bmslab objects are at most 64 KiB");
+
+public:
+	/* Objects are destroyed and freed to whichever slab owns them */
+	struct deleter {
+		void operator()(T *ptr) const noexcept
+		{
+			ptr->~T();
+			bmslab_free_any(ptr);
+		}
+	};
+
+	using unique_ptr = std::unique_ptr<T, deleter>;
+
+	explicit pool(int max_page_count, int magazine_size = 0)
+	{
+		struct bmslab_config config = {};
+
+		config.obj_size = sizeof(T) < 8 ? 8 : (int)sizeof(T);
+		config.max_page_count = max_page_count;
+		init(config, magazine_size);
+	}
+
+	/* config.obj_size is set from T */
+	explicit pool(struct bmslab_config config, int magazine_size = 0)
+	{
+		config.obj_size = sizeof(T) < 8 ? 8 : (int)sizeof(T);
+		init(config, magazine_size);
+	}
+
+	~pool()
+	{
+		bmslab_destroy(slab_);
+	}
+
+	pool(const pool &) = delete;
+	pool &operator=(const pool &) = delete;
+
+	pool(pool &&other) noexcept : slab_(std::exchange(other.slab_, nullptr)) {}
+
+	pool &operator=(pool &&other) noexcept
+	{
+		std::swap(slab_, other.slab_);
+		return *this;
+	}
+
+	/* Uninitialized storage for one T, nullptr if the slab is exhausted */
+	T *allocate() noexcept
+	{
+		return static_cast<T *>(bmslab_alloc(slab_));
+	}
+
+	void deallocate(T *ptr) noexcept
+	{
+		bmslab_free(slab_, ptr);
+	}
+
+	/* Throws std::bad_alloc if the slab is exhausted */
+	template <typename... Args>
+	T *make(Args &&...args)
+	{
+		void *ptr = bmslab_alloc(slab_);
+
+		if (ptr == nullptr)
+			throw std::bad_alloc();
+
+		try {
+			return ::new (ptr) T(std::forward<Args>(args)...);
+		} catch (...) {
+			bmslab_free(slab_, ptr);
+			throw;
+		}
+	}
+
+	void destroy(T *ptr) noexcept
+	{
+		if (ptr == nullptr)
+			return;
+
+		ptr->~T();
+		bmslab_free(slab_, ptr);
+	}
+
+	template <typename... Args>
+	unique_ptr make_unique(Args &&...args)
+	{
+		return unique_ptr(make(std::forward<Args>(args)...));
+	}
+
+	bmslab_t *get() const noexcept
+	{
+		return slab_;
+	}
+
+private:
+	void init(const struct bmslab_config &config, int magazine_size)
+	{
+		slab_ = bmslab_init_ex(&config);
+		if (slab_ == nullptr)
+			throw std::bad_alloc();
+
+		if (magazine_size > 0 &&
+				bmslab_enable_magazine(slab_, magazine_size) != 0) {
+			bmslab_destroy(slab_);
+			throw std::bad_alloc();
+		}
+	}
+
+	bmslab_t *slab_;
+};
+
+/*
+ * multi - owned bmslab_multi
+ *
+ * class_sizes as in bmslab_multi_init(), nullptr for the default classes.
+ */
+class multi {
+public:
+	explicit multi(int max_page_count, const int *class_sizes = nullptr,
+		int class_count = 0)
+		: multi_(bmslab_multi_init(class_sizes, class_count, max_page_count))
+	{
+		if (multi_ == nullptr)
+			throw std::bad_alloc();
+	}
+
+	~multi()
+	{
+		bmslab_multi_destroy(multi_);
+	}
+
+	multi(const multi &) = delete;
+	multi &operator=(const multi &) = delete;
+
+	bmslab_multi_t *get() const noexcept
+	{
+		return multi_;
+	}
+
+private:
+	bmslab_multi_t *multi_;
+};
+
+/* Give @ptr back to its slab, returns false if no slab owns it */
+inline bool free_owned(void *ptr) noexcept
+{
+	bmslab_t *slab = bmslab_owner(ptr);
+
+	if (slab == nullptr)
+		return false;
+
+	bmslab_free(slab, ptr);
+	return true;
+}
+
+/*
+ * allocator - std::allocator compatible allocator over a bmslab_multi
+ *
+ * Node containers allocate one node at a time, which the size classes serve.
+ * Arrays beyond the largest class, such as unordered_map buckets, and types
+ * aligned beyond every class that fits go to ::operator new.
+ */
+template <typename T>
+class allocator {
+public:
+	using value_type = T;
+
+	explicit allocator(bmslab_multi_t *multi) noexcept : multi_(multi) {}
+
+	template <typename U>
+	allocator(const allocator<U> &other) noexcept : multi_(other.multi_) {}
+
+	T *allocate(std::size_t n)
+	{
+		std::size_t size;
+		void *ptr;
+
+		if (n > SIZE_MAX / sizeof(T))
+			throw std::bad_array_new_length();
+
+		size = n * sizeof(T);
+		ptr = bmslab_multi_alloc_aligned(multi_, size, alignof(T));
+		if (ptr != nullptr)
+			return static_cast<T *>(ptr);
+
+		if constexpr (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			return static_cast<T *>(::operator new(size,
+				std::align_val_t(alignof(T))));
+		else
+			return static_cast<T *>(::operator new(size));
+	}
+
+	void deallocate(T *ptr, std::size_t n) noexcept
+	{
+		if (free_owned(ptr))
+			return;
+
+		if constexpr (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			::operator delete(ptr, n * sizeof(T), std::align_val_t(alignof(T)));
+		else
+			::operator delete(ptr, n * sizeof(T));
+	}
+
+	bmslab_multi_t *get() const noexcept
+	{
+		return multi_;
+	}
+
+	template <typename U>
+	bool operator==(const allocator<U> &other) const noexcept
+	{
+		return multi_ == other.multi_;
+	}
+
+private:
+	template <typename U>
+	friend class allocator;
+
+	bmslab_multi_t *multi_;
+};
+
+/*
+ * resource - std::pmr::memory_resource over a bmslab_multi
+ *
+ * Sizes and alignments that no class serves are taken from @upstream.
+ */
+class resource : public std::pmr::memory_resource {
+public:
+	explicit resource(bmslab_multi_t *multi,
+		std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+		noexcept : multi_(multi), upstream_(upstream) {}
+
+	bmslab_multi_t *get() const noexcept
+	{
+		return multi_;
+	}
+
+protected:
+	void *do_allocate(std::size_t bytes, std::size_t align) override
+	{
+		void *ptr = bmslab_multi_alloc_aligned(multi_, bytes, align);
+
+		return ptr != nullptr ? ptr : upstream_->allocate(bytes, align);
+	}
+
+	void do_deallocate(void *ptr, std::size_t bytes, std::size_t align) override
+	{
+		if (!free_owned(ptr))
+			upstream_->deallocate(ptr, bytes, align);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept
+		override
+	{
+		return this == &other;
+	}
+
+private:
+	bmslab_multi_t *multi_;
+	std::pmr::memory_resource *upstream_;
+};
+
+} // namespace bmslabpp
+
+#endif /* BMSLAB_HPP */
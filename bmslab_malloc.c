@@ -0,0 +1,328 @@
+/*
+ * bmslab_malloc: malloc interposer backed by bmslab size classes
+ *
+ * Built as libbmslab_malloc.so, to be loaded with LD_PRELOAD into unmodified
+ * binaries. Requests up to CLASS_MAX_SIZE bytes are served by one bmslab per
+ * size class, with per-thread magazines enabled. Larger requests, allocations
+ * made while a bmslab call is in progress on the same thread (bmslab itself
+ * uses malloc for its metadata), and requests that a class cannot satisfy are
+ * forwarded to the next allocator (glibc's __libc_* entry points).
+ *
+ * Frees find the owner of a pointer with bmslab_owner(), so pointers that came
+ * from the next allocator, including those returned by functions that are not
+ * interposed here (e.g. valloc), are handed back to it.
+ *
+ * bmslab quiesces its own locks around fork(). The class setup here is guarded
+ * by class_lock instead of a pthread_once, so that a child forked while another
+ * thread was creating the classes can start over.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bmslab.h"
+
+#define CLASS_COUNT			(20)
+#define CLASS_SHIFT			(4)
+#define CLASS_MAX_SIZE		(1024)
+#define CLASS_PAGE_COUNT	(1 << 16)
+#define CLASS_MAGAZINE_SIZE	(64)
+
+/* Every class is a multiple of 16 bytes, the alignment malloc guarantees */
+#define MIN_ALIGN			(16)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+
+static const int class_sizes[CLASS_COUNT] = {
+	16, 32, 48, 64, 80, 96, 112, 128, 160, 192,
+	224, 256, 320, 384, 448, 512, 640, 768, 896, 1024,
+};
+
+static uint8_t size_class[(CLASS_MAX_SIZE >> CLASS_SHIFT) + 1];
+static bmslab_t *class_slabs[CLASS_COUNT];
+static pthread_mutex_t class_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool class_tried = false;
+static _Atomic bool class_ready = false;
+
+static size_t (*next_malloc_usable_size)(void *ptr);
+
+/*
+ * Non-zero while this thread is inside bmslab. Initial-exec, so that reading
+ * it never allocates.
+ */
+static _Thread_local int in_bmslab __attribute__((tls_model("initial-exec")));
+
+/*
+ * class_init - create the size class slabs
+ *
+ * If any slab cannot be created, the classes stay disabled and every request
+ * goes to the next allocator.
+ */
+static void class_init(void)
+{
+	struct bmslab_config config = { 0 };
+	int class_idx = 0;
+
+	in_bmslab++;
+
+	for (int i = 0; i < CLASS_COUNT; i++) {
+		config.obj_size = class_sizes[i];
+		config.max_page_count = CLASS_PAGE_COUNT;
+
+		class_slabs[i] = bmslab_init_ex(&config);
+		if (class_slabs[i] == NULL ||
+				bmslab_enable_magazine(class_slabs[i], CLASS_MAGAZINE_SIZE)) {
+			for (int j = 0; j <= i; j++)
+				bmslab_destroy(class_slabs[j]);
+			in_bmslab--;
+			return;
+		}
+	}
+
+	/* Smallest class that fits each 16-byte step */
+	for (int i = 0; i <= (CLASS_MAX_SIZE >> CLASS_SHIFT); i++) {
+		while ((i << CLASS_SHIFT) > class_sizes[class_idx])
+			class_idx++;
+		size_class[i] = class_idx;
+	}
+
+	next_malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+
+	atomic_store_explicit(&class_ready, true, memory_order_release);
+	in_bmslab--;
+}
+
+/*
+ * class_fork_child - reset the class setup in the child of fork()
+ *
+ * If another thread held class_lock at fork(), it does not exist in the child.
+ * Slabs it had created are abandoned, and the next allocation runs class_init()
+ * again.
+ */
+static void class_fork_child(void)
+{
+	pthread_mutex_init(&class_lock, NULL);
+	if (!atomic_load_explicit(&class_ready, memory_order_relaxed))
+		class_tried = false;
+}
+
+/* pthread_atfork() may allocate, which must not recurse into the classes */
+__attribute__((constructor))
+static void class_register_fork(void)
+{
+	in_bmslab++;
+	pthread_atfork(NULL, NULL, class_fork_child);
+	in_bmslab--;
+}
+
+/*
+ * class_alloc - allocate from the smallest fitting size class
+ * @size: requested size
+ * @align: required alignment, a power of two
+ *
+ * Slots of a class are spaced by the class size from a page aligned start, so
+ * a class whose size is a multiple of @align returns aligned objects.
+ *
+ * Returns the object, or NULL if the request has to go to the next allocator.
+ */
+static void *class_alloc(size_t size, size_t align)
+{
+	int class_idx;
+	void *ptr;
+
+	if (in_bmslab || size > CLASS_MAX_SIZE || align > CLASS_MAX_SIZE)
+		return NULL;
+
+	if (!atomic_load_explicit(&class_ready, memory_order_acquire)) {
+		pthread_mutex_lock(&class_lock);
+		if (!class_tried) {
+			class_tried = true;
+			class_init();
+		}
+		pthread_mutex_unlock(&class_lock);
+
+		if (!atomic_load_explicit(&class_ready, memory_order_acquire))
+			return NULL;
+	}
+
+	class_idx = size_class[(size + MIN_ALIGN - 1) >> CLASS_SHIFT];
+	while (class_idx < CLASS_COUNT && (class_sizes[class_idx] & (align - 1)))
+		class_idx++;
+	if (class_idx == CLASS_COUNT)
+		return NULL;
+
+	in_bmslab++;
+	ptr = bmslab_alloc(class_slabs[class_idx]);
+	in_bmslab--;
+
+	return ptr;
+}
+
+/*
+ * class_free - free an object if it belongs to a size class
+ * @ptr: object pointer
+ *
+ * Returns true if @ptr was freed, false if it belongs to the next allocator.
+ */
+static bool class_free(void *ptr)
+{
+	bmslab_t *slab = bmslab_owner(ptr);
+
+	if (slab == NULL)
+		return false;
+
+	in_bmslab++;
+	bmslab_free(slab, ptr);
+	in_bmslab--;
+
+	return true;
+}
+
+/* Alignments that are not a power of two are left to the next allocator */
+static void *aligned_class_alloc(size_t align, size_t size)
+{
+	void *ptr = NULL;
+
+	if ((align & (align - 1)) == 0)
+		ptr = class_alloc(size, align < MIN_ALIGN ? MIN_ALIGN : align);
+
+	return ptr != NULL ? ptr : __libc_memalign(align, size);
+}
+
+void *malloc(size_t size)
+{
+	void *ptr = class_alloc(size, MIN_ALIGN);
+
+	return ptr != NULL ? ptr : __libc_malloc(size);
+}
+
+void free(void *ptr)
+{
+	if (ptr != NULL && !class_free(ptr))
+		__libc_free(ptr);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	size_t total;
+	void *ptr;
+
+	if (__builtin_mul_overflow(n, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* Slots are reused, unlike fresh pages they are not zero */
+	ptr = class_alloc(total, MIN_ALIGN);
+	if (ptr == NULL)
+		return __libc_calloc(n, size);
+
+	memset(ptr, 0, total);
+	return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	bmslab_t *slab;
+	size_t old_size;
+	void *new_ptr;
+
+	if (ptr == NULL)
+		return malloc(size);
+
+	slab = bmslab_owner(ptr);
+	if (slab == NULL)
+		return __libc_realloc(ptr, size);
+
+	if (size == 0) {
+		class_free(ptr);
+		return NULL;
+	}
+
+	old_size = get_bmslab_slot_size(slab);
+	if (size <= old_size)
+		return ptr;
+
+	new_ptr = malloc(size);
+	if (new_ptr == NULL)
+		return NULL;
+
+	memcpy(new_ptr, ptr, old_size);
+	class_free(ptr);
+	return new_ptr;
+}
+
+void *reallocarray(void *ptr, size_t n, size_t size)
+{
+	size_t total;
+
+	if (__builtin_mul_overflow(n, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return realloc(ptr, total);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+	void *ptr;
+
+	if (align < sizeof(void *) || (align & (align - 1)) != 0)
+		return EINVAL;
+
+	ptr = aligned_class_alloc(align, size);
+	if (ptr == NULL)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+	if (align == 0 || (align & (align - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return aligned_class_alloc(align, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+	return aligned_class_alloc(align, size);
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	bmslab_t *slab;
+
+	if (ptr == NULL)
+		return 0;
+
+	slab = bmslab_owner(ptr);
+	if (slab != NULL)
+		return get_bmslab_slot_size(slab);
+
+	/* Not resolved yet if no small allocation was made before */
+	if (next_malloc_usable_size == NULL) {
+		in_bmslab++;
+		next_malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+		in_bmslab--;
+	}
+
+	return next_malloc_usable_size != NULL ? next_malloc_usable_size(ptr) : 0;
+}
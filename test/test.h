@@ -0,0 +1,19 @@
+/*
+ * test.h: helpers shared by the bmslab tests
+ */
+#ifndef BMSLAB_TEST_H
+#define BMSLAB_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", \
+				__FILE__, __LINE__, #cond); \
+			exit(1); \
+		} \
+	} while (0)
+
+#endif /* BMSLAB_TEST_H */
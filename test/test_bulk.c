@@ -0,0 +1,186 @@
+/*
+ * test_bulk: bulk allocation and bulk free
+ *
+ * bmslab_alloc_bulk() returns fewer objects than asked only if the slab is
+ * exhausted, also right after pages were purged and have to be reused.
+ * Concurrent bulk claims never hand out a slot twice, and bmslab_free_bulk()
+ * frees objects spread over pages and submaps in any order.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bmslab.h"
+#include "test.h"
+
+#define PAGE_COUNT		(8)
+#define THREAD_COUNT	(4)
+#define ROUND_COUNT		(2000)
+#define BATCH_SIZE		(100)
+
+static void **ptrs;
+
+/* Fill the slab one object at a time, returns its capacity */
+static int alloc_all(bmslab_t *slab)
+{
+	int count = 0;
+
+	while ((ptrs[count] = bmslab_alloc(slab)) != NULL)
+		count++;
+
+	return count;
+}
+
+/* alloc all -> free_bulk all -> alloc_bulk(capacity) == capacity */
+static void test_reuse_after_purge(int obj_size)
+{
+	bmslab_t *slab = bmslab_init(obj_size, PAGE_COUNT);
+	int capacity;
+
+	CHECK(slab != NULL);
+
+	capacity = alloc_all(slab);
+	CHECK(capacity == PAGE_COUNT * get_bmslab_slot_count_per_page(slab));
+
+	for (int round = 0; round < 4; round++) {
+		bmslab_free_bulk(slab, ptrs, capacity);
+		CHECK(get_bmslab_allocated_slots(slab) == 0);
+
+		CHECK(bmslab_alloc_bulk(slab, ptrs, capacity) == capacity);
+		CHECK(bmslab_alloc(slab) == NULL);
+	}
+
+	bmslab_free_bulk(slab, ptrs, capacity);
+	bmslab_destroy(slab);
+}
+
+/* Bulk claims hand out every slot once, and only as many as there are */
+static void test_unique(int obj_size)
+{
+	bmslab_t *slab = bmslab_init(obj_size, PAGE_COUNT);
+	int capacity, got;
+
+	CHECK(slab != NULL);
+	capacity = PAGE_COUNT * get_bmslab_slot_count_per_page(slab);
+
+	got = bmslab_alloc_bulk(slab, ptrs, capacity + 100);
+	CHECK(got == capacity);
+	CHECK(bmslab_alloc_bulk(slab, ptrs + got, 1) == 0);
+
+	for (int i = 0; i < got; i++) {
+		CHECK(bmslab_owner(ptrs[i]) == slab);
+		memset(ptrs[i], 0, obj_size);
+		for (int j = 0; j < i; j++)
+			CHECK(ptrs[i] != ptrs[j]);
+	}
+
+	/* NULL and foreign entries are skipped */
+	ptrs[0] = NULL;
+	bmslab_free_bulk(slab, ptrs, got);
+	CHECK(get_bmslab_allocated_slots(slab) == 1);
+
+	bmslab_destroy(slab);
+}
+
+/* A magazine refills through the bulk path, the slab must still fill up */
+static void test_magazine_refill(int obj_size)
+{
+	bmslab_t *slab = bmslab_init(obj_size, PAGE_COUNT);
+	int capacity;
+
+	CHECK(slab != NULL);
+	capacity = alloc_all(slab);
+	bmslab_free_bulk(slab, ptrs, capacity);
+
+	CHECK(bmslab_enable_magazine(slab, 64) == 0);
+	for (int round = 0; round < 4; round++) {
+		CHECK(alloc_all(slab) == capacity);
+		for (int i = 0; i < capacity; i++)
+			bmslab_free(slab, ptrs[i]);
+	}
+
+	bmslab_destroy(slab);
+}
+
+/* Free half of the objects in a scattered order, then the rest */
+static void test_scattered_free(int obj_size)
+{
+	bmslab_t *slab = bmslab_init(obj_size, PAGE_COUNT);
+	int capacity, half = 0;
+
+	CHECK(slab != NULL);
+	capacity = alloc_all(slab);
+
+	/* Every third object first, so each submap is touched partly */
+	for (int i = 0; i < capacity; i += 3)
+		ptrs[half++] = ptrs[i];
+	bmslab_free_bulk(slab, ptrs, half);
+	CHECK(get_bmslab_allocated_slots(slab) == capacity - half);
+
+	CHECK(bmslab_alloc_bulk(slab, ptrs, capacity) == half);
+	CHECK(get_bmslab_allocated_slots(slab) == capacity);
+
+	bmslab_destroy(slab);
+}
+
+static bmslab_t *shared_slab;
+
+static void *bulk_worker(void *arg)
+{
+	uintptr_t id = (uintptr_t)arg;
+	void *objs[BATCH_SIZE];
+	unsigned int seed = (unsigned int)id;
+	int got;
+
+	for (int round = 0; round < ROUND_COUNT; round++) {
+		got = bmslab_alloc_bulk(shared_slab, objs,
+			1 + rand_r(&seed) % BATCH_SIZE);
+		CHECK(got > 0);
+
+		/* A slot handed out twice would show another thread's tag */
+		for (int i = 0; i < got; i++)
+			*(uintptr_t *)objs[i] = (id << 32) | i;
+		for (int i = 0; i < got; i++)
+			CHECK(*(uintptr_t *)objs[i] == ((id << 32) | i));
+
+		bmslab_free_bulk(shared_slab, objs, got);
+	}
+
+	return NULL;
+}
+
+static void test_concurrent(int obj_size)
+{
+	pthread_t threads[THREAD_COUNT];
+
+	shared_slab = bmslab_init(obj_size, THREAD_COUNT * BATCH_SIZE);
+	CHECK(shared_slab != NULL);
+
+	for (uintptr_t i = 0; i < THREAD_COUNT; i++)
+		CHECK(pthread_create(&threads[i], NULL, bulk_worker, (void *)i) == 0);
+	for (int i = 0; i < THREAD_COUNT; i++)
+		CHECK(pthread_join(threads[i], NULL) == 0);
+
+	CHECK(get_bmslab_allocated_slots(shared_slab) == 0);
+	bmslab_destroy(shared_slab);
+}
+
+int main(void)
+{
+	const int sizes[] = { 8, 64, 100, 1000, 4096, 6000 };
+
+	ptrs = malloc(sizeof(void *) * (PAGE_COUNT * 1024 + 100));
+	CHECK(ptrs != NULL);
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		test_reuse_after_purge(sizes[i]);
+		test_unique(sizes[i]);
+		test_magazine_refill(sizes[i]);
+		test_scattered_free(sizes[i]);
+		test_concurrent(sizes[i]);
+	}
+
+	free(ptrs);
+	printf("test_bulk: ok\n");
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * test_colour: slab colouring
+ *
+ * The tail space of a page offsets its first slot by a whole number of cache
+ * lines, the offsets rotate over the pages, and every object still fits in
+ * its page and keeps the slot alignment.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "bmslab.h"
+#include "test.h"
+
+#define PAGE_COUNT		(32)
+#define CACHELINE_SIZE	(64)
+
+static void *objs[PAGE_COUNT * 1024];
+
+static bmslab_t *init_slab(int obj_size, int slot_align, int colouring)
+{
+	struct bmslab_config config;
+
+	memset(&config, 0, sizeof(config));
+	config.obj_size = obj_size;
+	config.max_page_count = PAGE_COUNT;
+	config.slot_align = slot_align;
+	config.colouring = colouring;
+
+	return bmslab_init_ex(&config);
+}
+
+static void test_colour(int obj_size, int slot_align, int colouring)
+{
+	bmslab_t *slab = init_slab(obj_size, slot_align, colouring);
+	uintptr_t page_size, slot_size, step, tail, base = UINTPTR_MAX;
+	uintptr_t first[PAGE_COUNT];
+	int colour_count, count = 0;
+
+	CHECK(slab != NULL);
+	page_size = get_bmslab_page_size(slab);
+	slot_size = get_bmslab_slot_size(slab);
+	step = slot_align > CACHELINE_SIZE ? slot_align : CACHELINE_SIZE;
+	tail = page_size - get_bmslab_slot_count_per_page(slab) * slot_size;
+	colour_count = get_bmslab_colour_count(slab);
+
+	/* As many colours as steps fit in the tail, rounded down to a power of 2 */
+	CHECK((colour_count & (colour_count - 1)) == 0);
+	if (!colouring) {
+		CHECK(colour_count == 1);
+	} else {
+		CHECK((uintptr_t)colour_count <= tail / step + 1);
+		CHECK((uintptr_t)colour_count * 2 > tail / step + 1);
+	}
+
+	while ((objs[count] = bmslab_alloc(slab)) != NULL) {
+		if ((uintptr_t)objs[count] < base)
+			base = (uintptr_t)objs[count] & ~(page_size - 1);
+		count++;
+	}
+	CHECK(count == PAGE_COUNT * get_bmslab_slot_count_per_page(slab));
+
+	for (int i = 0; i < PAGE_COUNT; i++)
+		first[i] = page_size;
+
+	for (int i = 0; i < count; i++) {
+		uintptr_t addr = (uintptr_t)objs[i];
+		uintptr_t page = (addr - base) / page_size;
+		uintptr_t offset = (addr - base) % page_size;
+
+		CHECK(page < PAGE_COUNT);
+		CHECK(offset + obj_size <= page_size);
+		if (slot_align != 0)
+			CHECK(addr % slot_align == 0);
+		if (offset < first[page])
+			first[page] = offset;
+	}
+
+	/* Slot 0 of page i is moved by i modulo the colour count steps */
+	for (int i = 0; i < PAGE_COUNT; i++)
+		CHECK(first[i] == (uintptr_t)(i % colour_count) * step);
+
+	bmslab_free_bulk(slab, objs, count);
+	CHECK(get_bmslab_allocated_slots(slab) == 0);
+	bmslab_destroy(slab);
+}
+
+int main(void)
+{
+	/* Tails of 16, 96, 1096 and 96 bytes */
+	const int sizes[] = { 48, 1000, 3000, 200 };
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		test_colour(sizes[i], 0, 0);
+		test_colour(sizes[i], 0, 1);
+	}
+
+	/* Colours keep a slot alignment wider than a cache line */
+	test_colour(300, 128, 1);
+	/* Spans colour their tail as well */
+	test_colour(6000, 0, 1);
+
+	printf("test_colour: ok\n");
+	return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * test_fork: fork from a multithreaded process running on libbmslab_malloc.so
+ *
+ * Worker threads keep the bmslab locks busy: short-lived threads take
+ * magazine_lock when their magazines are created and drained, and batches
+ * of allocations make the slabs expand and shrink. The main thread forks
+ * meanwhile, and every child must be able to allocate, start a thread and
+ * exit. A child that deadlocks is killed by its alarm and fails the test.
+ *
+ * Run with LD_PRELOAD=../libbmslab_malloc.so (make check does so).
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define WORKER_COUNT	(4)
+#define FORK_COUNT		(200)
+#define BATCH_SIZE		(4096)
+#define CHILD_TIMEOUT	(10)
+
+static _Atomic int stop = 0;
+
+/* Allocate and free a batch of mixed sizes, enough to expand and shrink */
+static void churn(unsigned int seed)
+{
+	void **ptrs = malloc(sizeof(void *) * BATCH_SIZE);
+
+	if (ptrs == NULL)
+		abort();
+
+	for (int i = 0; i < BATCH_SIZE; i++) {
+		ptrs[i] = malloc(16 + (rand_r(&seed) % 1008));
+		if (ptrs[i] == NULL)
+			abort();
+		memset(ptrs[i], i, 16);
+	}
+
+	for (int i = 0; i < BATCH_SIZE; i++)
+		free(ptrs[i]);
+
+	free(ptrs);
+}
+
+static void *short_lived(void *arg)
+{
+	churn((unsigned int)(unsigned long)arg);
+	return NULL;
+}
+
+static void *worker(void *arg)
+{
+	unsigned int seed = (unsigned int)(unsigned long)arg;
+	pthread_t thread;
+
+	while (!atomic_load(&stop)) {
+		if (pthread_create(&thread, NULL, short_lived,
+				(void *)(unsigned long)rand_r(&seed)) == 0)
+			pthread_join(thread, NULL);
+		churn(rand_r(&seed));
+	}
+
+	return NULL;
+}
+
+static void child(void)
+{
+	pthread_t thread;
+
+	alarm(CHILD_TIMEOUT);
+
+	churn(getpid());
+	if (pthread_create(&thread, NULL, short_lived, NULL) != 0)
+		_exit(2);
+	pthread_join(thread, NULL);
+
+	_exit(0);
+}
+
+int main(void)
+{
+	pthread_t workers[WORKER_COUNT];
+	int status, failures = 0;
+	pid_t pid;
+
+	for (int i = 0; i < WORKER_COUNT; i++)
+		pthread_create(&workers[i], NULL, worker, (void *)(unsigned long)i);
+
+	for (int i = 0; i < FORK_COUNT; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0)
+			child();
+
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "test_fork: child %d %s %d\n", i,
+				WIFSIGNALED(status) ? "killed by signal" : "exited with",
+				WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+			failures++;
+		}
+	}
+
+	atomic_store(&stop, 1);
+	for (int i = 0; i < WORKER_COUNT; i++)
+		pthread_join(workers[i], NULL);
+
+	if (failures > 0) {
+		fprintf(stderr, "test_fork: %d of %d children failed\n",
+			failures, FORK_COUNT);
+		return 1;
+	}
+
+	printf("test_fork: ok\n");
+	return 0;
+}
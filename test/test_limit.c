@@ -0,0 +1,114 @@
+/*
+ * test_limit: moving the page limit with bmslab_set_limit()
+ *
+ * Lowering the limit purges the empty pages it cut off, and raising it again
+ * gives the whole capacity back.
+ */
+#include <string.h>
+
+#include "bmslab.h"
+#include "test.h"
+
+#define PAGE_COUNT	(32)
+#define LOW_LIMIT	(4)
+
+static void **ptrs;
+
+/* Fill the slab one object at a time, returns the number allocated */
+static int alloc_all(bmslab_t *slab)
+{
+	int count = 0;
+
+	while ((ptrs[count] = bmslab_alloc(slab)) != NULL)
+		count++;
+
+	return count;
+}
+
+static bmslab_t *init_slab(int obj_size)
+{
+	struct bmslab_config config;
+
+	memset(&config, 0, sizeof(config));
+	config.obj_size = obj_size;
+	config.max_page_count = PAGE_COUNT;
+	/* Keep the free path from purging, only the limit change may */
+	config.shrink_hysteresis = PAGE_COUNT;
+
+	return bmslab_init_ex(&config);
+}
+
+/* Empty pages above a lowered limit are purged right away */
+static void test_lower_purges(int obj_size)
+{
+	bmslab_t *slab = init_slab(obj_size);
+	int slots, capacity;
+
+	CHECK(slab != NULL);
+	slots = get_bmslab_slot_count_per_page(slab);
+
+	capacity = alloc_all(slab);
+	CHECK(capacity == PAGE_COUNT * slots);
+	bmslab_free_bulk(slab, ptrs, capacity);
+	CHECK(get_bmslab_purged_page_count(slab) == 0);
+
+	CHECK(bmslab_set_limit(slab, LOW_LIMIT) == 0);
+	CHECK(get_bmslab_page_limit(slab) == LOW_LIMIT);
+	CHECK(get_bmslab_purged_page_count(slab) == PAGE_COUNT - LOW_LIMIT);
+
+	CHECK(alloc_all(slab) == LOW_LIMIT * slots);
+	bmslab_free_bulk(slab, ptrs, LOW_LIMIT * slots);
+
+	CHECK(bmslab_set_limit(slab, PAGE_COUNT) == 0);
+	CHECK(alloc_all(slab) == capacity);
+	CHECK(get_bmslab_purged_page_count(slab) == 0);
+
+	bmslab_destroy(slab);
+}
+
+/* Pages still holding objects are left alone, their objects stay valid */
+static void test_lower_keeps_objects(int obj_size)
+{
+	bmslab_t *slab = init_slab(obj_size);
+	int capacity;
+
+	CHECK(slab != NULL);
+
+	capacity = alloc_all(slab);
+	for (int i = 0; i < capacity; i++)
+		memset(ptrs[i], i & 0xff, obj_size);
+
+	CHECK(bmslab_set_limit(slab, LOW_LIMIT) == 0);
+	CHECK(get_bmslab_purged_page_count(slab) == 0);
+	CHECK(bmslab_alloc(slab) == NULL);
+
+	for (int i = 0; i < capacity; i++)
+		CHECK(((unsigned char *)ptrs[i])[obj_size - 1] == (i & 0xff));
+	bmslab_free_bulk(slab, ptrs, capacity);
+	CHECK(get_bmslab_allocated_slots(slab) == 0);
+
+	CHECK(bmslab_set_limit(slab, 0) == -1);
+	CHECK(bmslab_set_limit(slab, PAGE_COUNT + 1) == -1);
+
+	CHECK(bmslab_set_limit(slab, PAGE_COUNT) == 0);
+	CHECK(alloc_all(slab) == capacity);
+
+	bmslab_destroy(slab);
+}
+
+int main(void)
+{
+	const int sizes[] = { 8, 64, 1000, 6000 };
+
+	ptrs = malloc(sizeof(void *) * (PAGE_COUNT * 1024 + 1));
+	CHECK(ptrs != NULL);
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		test_lower_purges(sizes[i]);
+		test_lower_keeps_objects(sizes[i]);
+	}
+
+	free(ptrs);
+	printf("test_limit: ok\n");
+	return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * test_magazine: per-thread magazines in front of bmslab_alloc/bmslab_free
+ *
+ * Objects are handed out once, may be freed by another thread than the one
+ * that allocated them, and the magazine of an exiting thread goes back to
+ * the slab.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bmslab.h"
+#include "test.h"
+
+#define PAGE_COUNT		(64)
+#define MAGAZINE_SIZE	(32)
+#define THREAD_COUNT	(4)
+#define ROUND_COUNT		(200)
+#define BATCH_SIZE		(500)
+
+static bmslab_t *slab;
+
+/* Objects one thread allocates and hands to the next one to free */
+static void *handoff[THREAD_COUNT][BATCH_SIZE];
+static pthread_barrier_t barrier;
+
+/* Every object of a batch is distinct and keeps what its owner wrote */
+static void fill_batch(void **objs, int count, uintptr_t tag)
+{
+	for (int i = 0; i < count; i++) {
+		objs[i] = bmslab_alloc(slab);
+		CHECK(objs[i] != NULL);
+		*(uintptr_t *)objs[i] = tag + i;
+	}
+
+	for (int i = 0; i < count; i++)
+		CHECK(*(uintptr_t *)objs[i] == tag + i);
+}
+
+static void *worker(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	void *local[BATCH_SIZE];
+
+	for (int round = 0; round < ROUND_COUNT; round++) {
+		/* Local churn stays in the magazine most of the time */
+		fill_batch(local, BATCH_SIZE, ((uintptr_t)id << 32) | round);
+		for (int i = 0; i < BATCH_SIZE; i++)
+			bmslab_free(slab, local[i]);
+
+		/* Free the objects of the previous thread, into this magazine */
+		fill_batch(handoff[id], BATCH_SIZE, ((uintptr_t)id << 48) | round);
+		pthread_barrier_wait(&barrier);
+		for (int i = 0; i < BATCH_SIZE; i++) {
+			void **objs = handoff[(id + THREAD_COUNT - 1) % THREAD_COUNT];
+			bmslab_free(slab, objs[i]);
+		}
+		pthread_barrier_wait(&barrier);
+	}
+
+	return NULL;
+}
+
+/* Threads exit with full magazines, which must be drained into the slab */
+static void test_threads(void)
+{
+	pthread_t threads[THREAD_COUNT];
+
+	slab = bmslab_init(64, PAGE_COUNT * 4);
+	CHECK(slab != NULL);
+	CHECK(bmslab_enable_magazine(slab, MAGAZINE_SIZE) == 0);
+	CHECK(pthread_barrier_init(&barrier, NULL, THREAD_COUNT) == 0);
+
+	for (int i = 0; i < THREAD_COUNT; i++) {
+		CHECK(pthread_create(&threads[i], NULL, worker,
+			(void *)(intptr_t)i) == 0);
+	}
+	for (int i = 0; i < THREAD_COUNT; i++)
+		CHECK(pthread_join(threads[i], NULL) == 0);
+
+	CHECK(get_bmslab_allocated_slots(slab) == 0);
+
+	pthread_barrier_destroy(&barrier);
+	bmslab_destroy(slab);
+}
+
+static int cmp_ptr(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)*(void *const *)a;
+	uintptr_t y = (uintptr_t)*(void *const *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Cached objects count as allocated, and the slab still fills up */
+static void test_capacity(void)
+{
+	static void *objs[PAGE_COUNT * 64];
+	int capacity = 0, count = 0;
+
+	slab = bmslab_init(64, PAGE_COUNT);
+	CHECK(slab != NULL);
+	CHECK(bmslab_enable_magazine(slab, MAGAZINE_SIZE) == 0);
+	capacity = PAGE_COUNT * get_bmslab_slot_count_per_page(slab);
+
+	/* Fill the magazine with a few frees, they still hold their slots */
+	for (int i = 0; i < MAGAZINE_SIZE; i++)
+		objs[i] = bmslab_alloc(slab);
+	for (int i = 0; i < MAGAZINE_SIZE; i++)
+		bmslab_free(slab, objs[i]);
+	CHECK(get_bmslab_allocated_slots(slab) > 0);
+
+	while ((objs[count] = bmslab_alloc(slab)) != NULL)
+		count++;
+	CHECK(count == capacity);
+
+	qsort(objs, count, sizeof(void *), cmp_ptr);
+	for (int i = 1; i < count; i++)
+		CHECK(objs[i - 1] != objs[i]);
+
+	for (int i = 0; i < count; i++)
+		bmslab_free(slab, objs[i]);
+	CHECK(get_bmslab_allocated_slots(slab) > 0);
+
+	bmslab_destroy(slab);
+}
+
+static void test_invalid_size(void)
+{
+	slab = bmslab_init(64, PAGE_COUNT);
+	CHECK(slab != NULL);
+	CHECK(bmslab_enable_magazine(slab, 0) == -1);
+	CHECK(bmslab_enable_magazine(slab, 1025) == -1);
+	CHECK(bmslab_enable_magazine(slab, 1024) == 0);
+	bmslab_destroy(slab);
+}
+
+int main(void)
+{
+	test_threads();
+	test_capacity();
+	test_invalid_size();
+
+	printf("test_magazine: ok\n");
+	return 0;
+}
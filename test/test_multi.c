@@ -0,0 +1,115 @@
+/*
+ * test_multi: size classes of bmslab_multi
+ *
+ * Every size is served by the smallest class that fits it, objects are freed
+ * without their size, and a full class does not affect the others.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "bmslab.h"
+#include "test.h"
+
+#define PAGE_COUNT	(16)
+
+/* The default table documented in README.md */
+static const int default_sizes[] = {
+	8, 16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256, 320, 384, 448, 512,
+	640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+	2560, 3072, 3584, 4096
+};
+
+#define DEFAULT_COUNT	((int)(sizeof(default_sizes) / sizeof(int)))
+
+static int smallest_class(const int *sizes, int count, size_t size)
+{
+	for (int i = 0; i < count; i++) {
+		if ((size_t)sizes[i] >= size)
+			return sizes[i];
+	}
+
+	return 0;
+}
+
+/* Each size lands in its class, and every class slab ends up empty */
+static void test_routing(const int *sizes, int count)
+{
+	bmslab_multi_t *multi = bmslab_multi_init(sizes, count, PAGE_COUNT);
+	int max_size;
+	void *ptr;
+
+	if (sizes == NULL) {
+		sizes = default_sizes;
+		count = DEFAULT_COUNT;
+	}
+	max_size = sizes[count - 1];
+
+	CHECK(multi != NULL);
+
+	for (size_t size = 1; size <= (size_t)max_size; size++) {
+		ptr = bmslab_multi_alloc(multi, size);
+		CHECK(ptr != NULL);
+		CHECK(bmslab_owner(ptr) != NULL);
+		CHECK(get_bmslab_slot_size(bmslab_owner(ptr))
+			== smallest_class(sizes, count, size));
+
+		memset(ptr, 0xab, size);
+		bmslab_multi_free(multi, ptr);
+		CHECK(get_bmslab_allocated_slots(bmslab_owner(ptr)) == 0);
+	}
+
+	CHECK(bmslab_multi_alloc(multi, max_size + 1) == NULL);
+	CHECK(bmslab_multi_alloc(multi, SIZE_MAX) == NULL);
+
+	bmslab_multi_destroy(multi);
+}
+
+/* Exhausting the largest class leaves the smaller ones usable */
+static void test_exhaust(void)
+{
+	static void *objs[PAGE_COUNT * 1024];
+	bmslab_multi_t *multi = bmslab_multi_init(NULL, 0, PAGE_COUNT);
+	int count = 0;
+
+	CHECK(multi != NULL);
+
+	while ((objs[count] = bmslab_multi_alloc(multi, 4000)) != NULL)
+		count++;
+	CHECK(count == PAGE_COUNT);
+
+	objs[count] = bmslab_multi_alloc(multi, 8);
+	CHECK(objs[count] != NULL);
+	count++;
+
+	for (int i = 0; i < count; i++)
+		bmslab_multi_free(multi, objs[i]);
+	CHECK(bmslab_multi_alloc(multi, 4000) != NULL);
+
+	bmslab_multi_destroy(multi);
+}
+
+static void test_invalid_tables(void)
+{
+	const int descending[] = { 16, 8 };
+	const int unaligned[] = { 8, 12 };
+	const int too_large[] = { 8, 8192 };
+
+	CHECK(bmslab_multi_init(descending, 2, PAGE_COUNT) == NULL);
+	CHECK(bmslab_multi_init(unaligned, 2, PAGE_COUNT) == NULL);
+	CHECK(bmslab_multi_init(too_large, 2, PAGE_COUNT) == NULL);
+	CHECK(bmslab_multi_init(default_sizes, 0, PAGE_COUNT) == NULL);
+}
+
+int main(void)
+{
+	const int custom[] = { 24, 104, 1000 };
+
+	test_routing(NULL, 0);
+	test_routing(custom, 3);
+	test_exhaust();
+	test_invalid_tables();
+
+	printf("test_multi: ok\n");
+	return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * test_multi_align: alignment of the C++ wrappers over a bmslab_multi
+ *
+ * The class table is made of multiples of 8 that are not multiples of 16, so
+ * a request of 16-byte alignment must skip to a class whose size is a multiple
+ * of 16, or fall back when there is none.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <memory_resource>
+
+#include "bmslab.hpp"
+#include "test.h"
+
+struct alignas(16) node16 {
+	char data[16];
+};
+
+struct alignas(64) node64 {
+	char data[64];
+};
+
+static bool aligned(const void *ptr, std::size_t align)
+{
+	return ((std::uintptr_t)ptr & (align - 1)) == 0;
+}
+
+/* C API: classes are picked by size and alignment */
+static void test_c_api(bmslab_multi_t *multi)
+{
+	for (int i = 0; i < 256; i++) {
+		void *ptr8 = bmslab_multi_alloc_aligned(multi, 16, 8);
+		void *ptr16 = bmslab_multi_alloc_aligned(multi, 16, 16);
+
+		CHECK(ptr8 != nullptr && aligned(ptr8, 8));
+		CHECK(get_bmslab_slot_size(bmslab_owner(ptr8)) == 24);
+		CHECK(ptr16 != nullptr && aligned(ptr16, 16));
+		CHECK(get_bmslab_slot_size(bmslab_owner(ptr16)) == 48);
+
+		bmslab_multi_free(multi, ptr8);
+		bmslab_multi_free(multi, ptr16);
+	}
+
+	/* No class is a multiple of 64, nor larger than 48 */
+	CHECK(bmslab_multi_alloc_aligned(multi, 8, 64) == nullptr);
+	CHECK(bmslab_multi_alloc_aligned(multi, 56, 8) == nullptr);
+	CHECK(bmslab_multi_alloc_aligned(multi, 8, 3) == nullptr);
+}
+
+/* std::allocator: over-aligned nodes come from an aligned class or new */
+static void test_allocator(bmslab_multi_t *multi)
+{
+	bmslabpp::allocator<node16> alloc16(multi);
+	bmslabpp::allocator<node64> alloc64(multi);
+	node16 *nodes16[256];
+	node64 *nodes64[16];
+
+	for (int i = 0; i < 256; i++) {
+		nodes16[i] = alloc16.allocate(1);
+		CHECK(aligned(nodes16[i], alignof(node16)));
+		CHECK(bmslab_owner(nodes16[i]) != nullptr);
+	}
+	for (int i = 0; i < 256; i++)
+		alloc16.deallocate(nodes16[i], 1);
+
+	for (int i = 0; i < 16; i++) {
+		nodes64[i] = alloc64.allocate(1);
+		CHECK(aligned(nodes64[i], alignof(node64)));
+		CHECK(bmslab_owner(nodes64[i]) == nullptr);
+	}
+	for (int i = 0; i < 16; i++)
+		alloc64.deallocate(nodes64[i], 1);
+
+	std::list<node16, bmslabpp::allocator<node16>> list(alloc16);
+	for (int i = 0; i < 1000; i++)
+		list.emplace_back();
+	for (const node16 &node : list)
+		CHECK(aligned(&node, alignof(node16)));
+}
+
+/* pmr: every alignment the contract allows is honoured */
+static void test_resource(bmslab_multi_t *multi)
+{
+	bmslabpp::resource resource(multi);
+
+	for (std::size_t align = 1; align <= 256; align <<= 1) {
+		for (std::size_t bytes = 1; bytes <= 64; bytes += 7) {
+			void *ptr = resource.allocate(bytes, align);
+
+			CHECK(aligned(ptr, align));
+			resource.deallocate(ptr, bytes, align);
+		}
+	}
+}
+
+int main()
+{
+	const int class_sizes[] = { 8, 24, 40, 48 };
+	bmslabpp::multi multi(64, class_sizes, 4);
+
+	test_c_api(multi.get());
+	test_allocator(multi.get());
+	test_resource(multi.get());
+
+	printf("test_multi_align: ok\n");
+	return 0;
+}
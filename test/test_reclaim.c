@@ -0,0 +1,131 @@
+/*
+ * test_reclaim: purging empty pages anywhere and reusing them
+ *
+ * One long-lived object must not keep the other pages resident, and purged
+ * pages are reused before the slab grows, with every slot available again.
+ * The background reclaimer does the purging with a shrink threshold of 99%,
+ * so the result does not depend on when usage drops below the threshold.
+ */
+#include <string.h>
+#include <time.h>
+
+#include "bmslab.h"
+#include "test.h"
+
+#define PAGE_COUNT		(64)
+#define RECLAIM_MS		(5)
+#define WAIT_MS			(5000)
+
+static void *objs[PAGE_COUNT * 1024];
+
+static bmslab_t *init_slab(int obj_size, int decay_ms)
+{
+	struct bmslab_config config;
+
+	memset(&config, 0, sizeof(config));
+	config.obj_size = obj_size;
+	config.max_page_count = PAGE_COUNT;
+	config.decay_ms = decay_ms;
+	config.background_reclaim = 1;
+	/* Purge every empty page, whatever the usage of the others */
+	config.expand_threshold = 100;
+	config.shrink_threshold = 99;
+
+	return bmslab_init_ex(&config);
+}
+
+/* Fill the slab one object at a time, returns the number allocated */
+static int alloc_all(bmslab_t *slab, void **out)
+{
+	int count = 0;
+
+	while ((out[count] = bmslab_alloc(slab)) != NULL)
+		count++;
+
+	return count;
+}
+
+/* Give the reclaimer up to WAIT_MS to purge down to @purged pages */
+static int wait_purged(bmslab_t *slab, int purged)
+{
+	struct timespec ts = { 0, 1000000L };
+
+	for (int ms = 0; ms < WAIT_MS; ms++) {
+		if (get_bmslab_purged_page_count(slab) == purged)
+			break;
+		nanosleep(&ts, NULL);
+	}
+
+	return get_bmslab_purged_page_count(slab);
+}
+
+/* Everything but one pinned object is freed, all other pages get purged */
+static void test_pinned(int obj_size, int where)
+{
+	bmslab_t *slab = init_slab(obj_size, 0);
+	int capacity, count, pinned;
+
+	CHECK(slab != NULL);
+	capacity = alloc_all(slab, objs);
+	CHECK(capacity == PAGE_COUNT * get_bmslab_slot_count_per_page(slab));
+	pinned = where * (capacity - 1) / 2;
+	CHECK(get_bmslab_phys_page_count(slab) == PAGE_COUNT);
+
+	for (int i = 0; i < capacity; i++) {
+		if (i != pinned)
+			bmslab_free(slab, objs[i]);
+	}
+	CHECK(get_bmslab_allocated_slots(slab) == 1);
+	CHECK(wait_purged(slab, PAGE_COUNT - 1) == PAGE_COUNT - 1);
+	CHECK(get_bmslab_dirty_page_count(slab) == 0);
+
+	/* Purged pages come back, the slab neither grows nor loses a slot */
+	count = alloc_all(slab, objs);
+	CHECK(count == capacity - 1);
+	CHECK(get_bmslab_purged_page_count(slab) == 0);
+	CHECK(get_bmslab_phys_page_count(slab) == PAGE_COUNT);
+
+	for (int i = 0; i < count; i++)
+		memset(objs[i], 0x5a, obj_size);
+
+	bmslab_free_bulk(slab, objs, count);
+	CHECK(get_bmslab_allocated_slots(slab) == 1);
+	bmslab_destroy(slab);
+}
+
+/* With decay, pages that just became empty stay resident */
+static void test_decay_keeps_pages(int obj_size)
+{
+	bmslab_t *slab = init_slab(obj_size, 10000);
+	int capacity;
+
+	CHECK(slab != NULL);
+	capacity = alloc_all(slab, objs);
+
+	for (int i = 0; i < capacity; i++)
+		bmslab_free(slab, objs[i]);
+	CHECK(get_bmslab_allocated_slots(slab) == 0);
+	CHECK(get_bmslab_purged_page_count(slab) == 0);
+	CHECK(get_bmslab_dirty_page_count(slab) == PAGE_COUNT);
+
+	CHECK(alloc_all(slab, objs) == capacity);
+	CHECK(get_bmslab_dirty_page_count(slab) == 0);
+	bmslab_destroy(slab);
+}
+
+int main(void)
+{
+	const int sizes[] = { 8, 64, 1000, 4096, 6000 };
+
+	CHECK(bmslab_set_reclaim_interval(RECLAIM_MS) == 0);
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		/* Pin the first object, one in the middle, and the last */
+		for (int where = 0; where <= 2; where++)
+			test_pinned(sizes[i], where);
+		test_decay_keeps_pages(sizes[i]);
+	}
+
+	printf("test_reclaim: ok\n");
+	return 0;
+}
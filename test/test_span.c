@@ -0,0 +1,92 @@
+/*
+ * test_span: objects larger than 4096 bytes in multi-page spans
+ *
+ * The span is the smallest power of two wasting at most 1/8 of itself, or
+ * the one wasting least. Objects lie inside their span, and a slab of spans
+ * fills, frees and refills like any other.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "bmslab.h"
+#include "test.h"
+
+#define PAGE_COUNT		(16)
+#define MIN_SPAN_SHIFT	(13)
+#define MAX_SPAN_SHIFT	(18)
+
+static void *objs[PAGE_COUNT * 64];
+
+/* The span size README.md promises for obj_size */
+static int expected_span(int obj_size)
+{
+	int best = 0, best_waste = 0;
+
+	for (int shift = MIN_SPAN_SHIFT; shift <= MAX_SPAN_SHIFT; shift++) {
+		int span = 1 << shift;
+		int waste = span % obj_size;
+
+		if (span < obj_size)
+			continue;
+		if (waste * 8 <= span)
+			return span;
+		if (best == 0 || waste * best < best_waste * span) {
+			best = span;
+			best_waste = waste;
+		}
+	}
+
+	return best;
+}
+
+static void test_span(int obj_size)
+{
+	bmslab_t *slab = bmslab_init(obj_size, PAGE_COUNT);
+	int span, capacity, count = 0;
+	uintptr_t start;
+
+	CHECK(slab != NULL);
+	span = get_bmslab_page_size(slab);
+	CHECK(span == expected_span(obj_size));
+	CHECK(get_bmslab_slot_count_per_page(slab) == span / obj_size);
+	capacity = PAGE_COUNT * (span / obj_size);
+
+	while ((objs[count] = bmslab_alloc(slab)) != NULL) {
+		start = (uintptr_t)objs[count] & ~((uintptr_t)span - 1);
+		CHECK((uintptr_t)objs[count] + obj_size <= start + span);
+		CHECK(((uintptr_t)objs[count] - start) % obj_size == 0);
+		memset(objs[count], count & 0xff, obj_size);
+		count++;
+	}
+	CHECK(count == capacity);
+
+	/* No object overlaps another one */
+	for (int i = 0; i < count; i++) {
+		CHECK(((unsigned char *)objs[i])[0] == (i & 0xff));
+		CHECK(((unsigned char *)objs[i])[obj_size - 1] == (i & 0xff));
+	}
+
+	for (int i = 0; i < count; i++)
+		bmslab_free_any(objs[i]);
+	CHECK(get_bmslab_allocated_slots(slab) == 0);
+
+	CHECK(bmslab_alloc_bulk(slab, objs, capacity) == capacity);
+	bmslab_free_bulk(slab, objs, capacity);
+
+	bmslab_destroy(slab);
+}
+
+int main(void)
+{
+	const int sizes[] = {
+		4104, 5000, 6144, 8192, 10000, 20000, 33000, 50000, 65536
+	};
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		test_span(sizes[i]);
+
+	CHECK(bmslab_init(65537, PAGE_COUNT) == NULL);
+
+	printf("test_span: ok\n");
+	return 0;
+}
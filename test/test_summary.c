@@ -0,0 +1,96 @@
+/*
+ * test_summary: finding the last free slots through the page summary
+ *
+ * With every other slot taken, an allocation has to find the few free slots
+ * wherever they are, on any page and behind any summary word, with both
+ * placements.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "bmslab.h"
+#include "test.h"
+
+#define PAGE_COUNT	(5000)
+#define ROUND_COUNT	(2000)
+#define HOLE_COUNT	(7)
+
+static void *objs[PAGE_COUNT * 64];
+
+static bmslab_t *init_slab(int obj_size, int placement)
+{
+	struct bmslab_config config;
+
+	memset(&config, 0, sizeof(config));
+	config.obj_size = obj_size;
+	config.max_page_count = PAGE_COUNT;
+	config.placement = placement;
+
+	return bmslab_init_ex(&config);
+}
+
+static void test_holes(int obj_size, int placement)
+{
+	bmslab_t *slab = init_slab(obj_size, placement);
+	unsigned int seed = (unsigned int)obj_size;
+	int capacity, count = 0, idx[HOLE_COUNT];
+	void *got[HOLE_COUNT + 1];
+
+	CHECK(slab != NULL);
+	capacity = PAGE_COUNT * get_bmslab_slot_count_per_page(slab);
+
+	while ((objs[count] = bmslab_alloc(slab)) != NULL)
+		count++;
+	CHECK(count == capacity);
+
+	/* A single hole is the only slot an allocation can return */
+	for (int round = 0; round < ROUND_COUNT; round++) {
+		int i = rand_r(&seed) % capacity;
+
+		bmslab_free(slab, objs[i]);
+		CHECK(bmslab_alloc(slab) == objs[i]);
+		CHECK(bmslab_alloc(slab) == NULL);
+	}
+
+	/* Several holes on distant pages are all found by one bulk claim */
+	for (int round = 0; round < ROUND_COUNT / 10; round++) {
+		for (int h = 0; h < HOLE_COUNT; h++) {
+			idx[h] = rand_r(&seed) % capacity;
+			for (int k = 0; k < h; k++) {
+				if (idx[k] == idx[h]) {
+					h--;
+					break;
+				}
+			}
+		}
+
+		for (int h = 0; h < HOLE_COUNT; h++)
+			bmslab_free(slab, objs[idx[h]]);
+
+		CHECK(bmslab_alloc_bulk(slab, got, HOLE_COUNT + 1) == HOLE_COUNT);
+		for (int h = 0; h < HOLE_COUNT; h++) {
+			int found = 0;
+
+			for (int k = 0; k < HOLE_COUNT; k++)
+				found |= got[k] == objs[idx[h]];
+			CHECK(found);
+		}
+	}
+
+	bmslab_free_bulk(slab, objs, capacity);
+	CHECK(get_bmslab_allocated_slots(slab) == 0);
+	bmslab_destroy(slab);
+}
+
+int main(void)
+{
+	const int sizes[] = { 64, 2048, 4096 };
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		test_holes(sizes[i], BMSLAB_PLACEMENT_HASH);
+		test_holes(sizes[i], BMSLAB_PLACEMENT_HOME);
+	}
+
+	printf("test_summary: ok\n");
+	return 0;
+}